@@ -0,0 +1,591 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "engine/physics/domain.hpp"
+#include "engine/physics/physics.hpp"
+#include "engine/physics/recorder.hpp"
+#include "engine/physics/snapshot.hpp"
+#include "engine/physics/spatial_queries.hpp"
+
+using namespace std::chrono;
+
+// Every heap allocation of the process, to report the allocations made by the solver.
+// Kept out of line so the compiler never pairs the inlined free() with a new expression.
+std::atomic<size_t> allocation_count{0};
+
+[[gnu::noinline]] void* operator new(size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc{};
+}
+
+[[gnu::noinline]] void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+[[gnu::noinline]] void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete[](void* ptr) noexcept {
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete(void* ptr, size_t) noexcept {
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete[](void* ptr, size_t) noexcept {
+    std::free(ptr);
+}
+
+struct Scenario {
+    std::string name;
+    Vec2 world_size;
+    int frames;                                                 // default number of frames to simulate
+    std::function<void(PhysicsSolver&, std::mt19937&)> setup;   // called once before the first frame
+    std::function<void(PhysicsSolver&, int)> before_frame;      // called before every frame, can be empty
+};
+
+struct Result {
+    size_t objects = 0;
+    int frames = 0;
+    int sub_steps = 0;
+    double setup_ns = 0.0;
+    double physics_ns = 0.0;
+    double narrowphase_ns = 0.0;
+    double constraints_ns = 0.0;
+    size_t constraints = 0;
+    size_t links = 0;  // links left at the end
+    size_t collisions = 0;
+    size_t moved = 0;
+    size_t pairs = 0;
+    size_t candidates = 0;
+    double contacts = 0.0;  // contacts per solver iteration, summed over substeps
+    size_t pair_builds = 0;
+    size_t allocations = 0;
+    int sleeping = 0;
+    long peak_rss_kb = 0;
+    double checksum = 0.0;
+    std::vector<Vec2> positions;  // final positions in id order
+};
+
+// Resets the peak resident set size of the process so every scenario reports its own peak (Linux only)
+void resetPeakRSS() {
+    std::ofstream clear_refs("/proc/self/clear_refs");
+    if (clear_refs) {
+        clear_refs << "5";
+    }
+}
+
+long readPeakRSS() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.rfind("VmHWM:", 0) == 0) {
+            return std::atol(line.c_str() + 6);
+        }
+    }
+    return 0;
+}
+
+// Packs balls in a hexagonal lattice from the bottom of the world upwards, added in a single batch
+void fillPile(PhysicsSolver& solver, std::mt19937& rng, int count, float spacing, float jitter) {
+    std::uniform_real_distribution<float> offset(-jitter, jitter);
+    const float margin = 1.0f;
+    const float row_height = spacing * std::sqrt(3.0f) * 0.5f;
+    std::vector<PhysicsObject> objects;
+    objects.reserve(count);
+    int row = 0;
+    while (count > 0) {
+        const float y = solver.world_size.y - margin - row * row_height;
+        if (y < margin) {
+            break;
+        }
+        const float x_start = margin + ((row & 1) ? spacing * 0.5f : 0.0f);
+        for (float x = x_start; x <= solver.world_size.x - margin && count > 0; x += spacing) {
+            objects.emplace_back(Vec2{x + offset(rng), y + offset(rng)});
+            count--;
+        }
+        row++;
+    }
+    solver.addObjects(objects);
+}
+
+// As much area of small balls as of balls ratio times bigger, shelf packed from the bottom biggest first. The small
+// balls settle into the gaps between the big ones.
+void fillMix(PhysicsSolver& solver, std::mt19937& rng, float ratio) {
+    std::uniform_real_distribution<float> offset(-0.01f, 0.01f);
+    const int small_count = 20000;
+    const float small_radius = 0.5f;
+    const int big_count = static_cast<int>(small_count / (ratio * ratio));
+    const float gap = 0.05f;
+    std::vector<PhysicsObject> objects;
+    objects.reserve(small_count + big_count);
+    float floor = solver.world_size.y - solver.wall_margin;  // bottom of the current shelf
+    float height = 0.0f;                                       // of the current shelf, the diameter of its first ball
+    float cursor = solver.wall_margin;
+    for (int i = 0; i < big_count + small_count; i++) {
+        const float radius = i < big_count ? small_radius * ratio : small_radius;
+        if (cursor + 2.0f * radius > solver.world_size.x - solver.wall_margin) {
+            floor -= height + gap;
+            height = 0.0f;
+            cursor = solver.wall_margin;
+        }
+        if (floor - 2.0f * radius < solver.wall_margin) {
+            break;
+        }
+        height = std::max(height, 2.0f * radius);
+        PhysicsObject& object = objects.emplace_back(Vec2{cursor + radius + offset(rng), floor - radius + offset(rng)});
+        object.radius = radius;
+        cursor += 2.0f * radius + gap;
+    }
+    solver.addObjects(objects);
+}
+
+// Square blobs of balls held together by links to their 8 neighbours, dropped in a heap. Diagonal links are weaker and
+// break when stretched by half their length.
+void fillSoftBodies(PhysicsSolver& solver, int count, int side) {
+    const float spacing = 1.0f;
+    const float body_size = side * spacing + 1.0f;
+    const int per_row = static_cast<int>((solver.world_size.x - 2.0f) / body_size);
+    std::vector<PhysicsObject> objects;
+    objects.reserve(count * side * side);
+    for (int body = 0; body < count; body++) {
+        const float left = 1.5f + (body % per_row) * body_size;
+        const float top = solver.world_size.y - 1.5f - (body / per_row + 1) * body_size;
+        for (int y = 0; y < side; y++) {
+            for (int x = 0; x < side; x++) {
+                objects.emplace_back(Vec2{left + x * spacing, top + y * spacing});
+            }
+        }
+    }
+    const int first = solver.addObjects(objects);
+    for (int body = 0; body < count; body++) {
+        const auto handle = [&](int x, int y) { return solver.getHandle(first + (body * side + y) * side + x); };
+        for (int y = 0; y < side; y++) {
+            for (int x = 0; x < side; x++) {
+                if (x + 1 < side) {
+                    solver.addLink(handle(x, y), handle(x + 1, y));
+                }
+                if (y + 1 < side) {
+                    solver.addLink(handle(x, y), handle(x, y + 1));
+                }
+                if (x + 1 < side && y + 1 < side) {
+                    solver.addLink(handle(x, y), handle(x + 1, y + 1), 0.5f, 0.5f);
+                    solver.addLink(handle(x + 1, y), handle(x, y + 1), 0.5f, 0.5f);
+                }
+            }
+        }
+    }
+}
+
+std::vector<Scenario> makeScenarios() {
+    std::vector<Scenario> scenarios;
+
+    // Same emitter as the interactive demo: 20 balls per frame until 26000
+    scenarios.push_back({"emitter", {150.0f, 150.0f}, 1500, [](PhysicsSolver&, std::mt19937&) {}, [](PhysicsSolver& solver, int) {
+                             if (solver.particles.size() < 26000) {
+                                 std::array<PhysicsObject, 20> objects;
+                                 for (int i = 20; i--;) {
+                                     PhysicsObject& object = objects[19 - i];
+                                     object.setPosition({2.0f, 10.0f + 1.1f * i});
+                                     object.last_position.x -= 0.2f;
+                                 }
+                                 solver.addObjects(objects);
+                             }
+                         }});
+
+    // Endless emitter over a drain in the bottom right corner, the ball count levels off once as many leave as arrive
+    scenarios.push_back({"drain", {150.0f, 150.0f}, 3000, [](PhysicsSolver&, std::mt19937&) {}, [](PhysicsSolver& solver, int) {
+                             std::array<PhysicsObject, 20> objects;
+                             for (int i = 20; i--;) {
+                                 PhysicsObject& object = objects[19 - i];
+                                 object.setPosition({2.0f, 10.0f + 1.1f * i});
+                                 object.last_position.x -= 0.2f;
+                             }
+                             solver.addObjects(objects);
+                             // Backwards, the particle moved into a removed slot was already checked
+                             const Particles& particles = solver.particles;
+                             for (int i = particles.size(); i--;) {
+                                 if (particles.x[i] > 110.0f && particles.y[i] > 145.0f) {
+                                     solver.removeObject(solver.getHandle(i));
+                                 }
+                             }
+                         }});
+
+    // Balls already touching each other at rest, the common case once the emitter is done
+    scenarios.push_back({"dense_pile", {150.0f, 150.0f}, 300, [](PhysicsSolver& solver, std::mt19937& rng) { fillPile(solver, rng, 24000, 1.0f, 0.0f); }, {}});
+
+    // Few balls without gravity moving in random directions
+    scenarios.push_back({"sparse_gas", {150.0f, 150.0f}, 300, [](PhysicsSolver& solver, std::mt19937& rng) {
+                             std::uniform_real_distribution<float> coord(2.0f, 148.0f);
+                             std::uniform_real_distribution<float> velocity(-0.1f, 0.1f);
+                             solver.gravity = {0.0f, 0.0f};
+                             std::vector<PhysicsObject> objects(2000);
+                             for (PhysicsObject& object : objects) {
+                                 object.setPosition({coord(rng), coord(rng)});
+                                 object.last_position -= Vec2{velocity(rng), velocity(rng)};
+                             }
+                             solver.addObjects(objects);
+                         },
+                         {}});
+
+    // Loosely packed piles falling and settling
+    // Mixed sizes, radius ratios of 1:1, 1:4 and 1:16
+    scenarios.push_back({"mix_1_1", {250.0f, 250.0f}, 300, [](PhysicsSolver& solver, std::mt19937& rng) { fillMix(solver, rng, 1.0f); }, {}});
+    scenarios.push_back({"mix_1_4", {250.0f, 250.0f}, 300, [](PhysicsSolver& solver, std::mt19937& rng) { fillMix(solver, rng, 4.0f); }, {}});
+    scenarios.push_back({"mix_1_16", {250.0f, 250.0f}, 300, [](PhysicsSolver& solver, std::mt19937& rng) { fillMix(solver, rng, 16.0f); }, {}});
+
+    // 150 soft bodies of 7x7 balls, 23k links
+    scenarios.push_back({"soft_bodies", {150.0f, 150.0f}, 300, [](PhysicsSolver& solver, std::mt19937&) { fillSoftBodies(solver, 150, 7); }, {}});
+
+    scenarios.push_back({"pile_100k", {400.0f, 400.0f}, 60, [](PhysicsSolver& solver, std::mt19937& rng) { fillPile(solver, rng, 100000, 1.05f, 0.02f); }, {}});
+    scenarios.push_back({"pile_500k", {900.0f, 900.0f}, 20, [](PhysicsSolver& solver, std::mt19937& rng) { fillPile(solver, rng, 500000, 1.05f, 0.02f); }, {}});
+    scenarios.push_back({"pile_1m", {2000.0f, 2000.0f}, 10, [](PhysicsSolver& solver, std::mt19937& rng) { fillPile(solver, rng, 1000000, 1.05f, 0.02f); }, {}});
+
+    return scenarios;
+}
+
+// Solver settings shared by every scenario of a run
+struct Options {
+    unsigned seed = 42;
+    Broadphase broadphase = Broadphase::QuadTree;
+    int threads = 0;
+    bool incremental_index = true;
+    int reorder_interval = 0;
+    int sleep_steps = 0;
+    bool adaptive_sub_steps = false;
+    bool batched_narrowphase = true;
+    ContactSolver contact_solver = ContactSolver::GaussSeidel;
+    int solver_iterations = 0;  // 0 keeps the solver default
+    int processes = 0;          // also runs the scenarios split over that many processes and compares them when set
+    int queries = 0;            // batches of that many radius, box and nearest queries run at the end of each scenario when set
+    std::string profile_prefix;  // profiles are written to <prefix>_<scenario>.csv, .json and .trace.json when set
+    std::string load_prefix;     // scenarios start from <prefix>_<scenario>.snap instead of their setup when set
+    std::string save_prefix;     // the final state of each scenario is saved to <prefix>_<scenario>.snap when set
+    std::string record_prefix;   // every frame of each scenario is recorded to <prefix>_<scenario>.traj when set
+};
+
+void writeProfile(const Profiler& profiler, const std::string& path) {
+    std::ofstream csv{path + ".csv"};
+    profiler.writeCsv(csv);
+    std::ofstream json{path + ".json"};
+    profiler.writeJson(json);
+    std::ofstream trace{path + ".trace.json"};
+    profiler.writeChromeTrace(trace);
+}
+
+// Runs one batch of each kind of spatial query on the final state, while the solver runs one more frame on another thread
+void runQueries(PhysicsSolver& solver, std::mt19937& rng, const Options& options, float dt) {
+    std::uniform_real_distribution<float> coord_x(0.0f, solver.world_size.x);
+    std::uniform_real_distribution<float> coord_y(0.0f, solver.world_size.y);
+    std::vector<QueryCircle> circles;
+    std::vector<QuadCell> boxes;
+    std::vector<NearestQuery> nearest;
+    for (int i = 0; i < options.queries; i++) {
+        circles.push_back({{coord_x(rng), coord_y(rng)}, 3.0f});
+        boxes.emplace_back(Vec2{coord_x(rng), coord_y(rng)}, 6.0f, 4.0f);
+        nearest.push_back({{coord_x(rng), coord_y(rng)}, 8});
+    }
+
+    SpatialQueries queries{solver.world_size, 2.0f, options.threads};
+    auto start = steady_clock::now();
+    queries.update(solver.particles);
+    const double update_ms = duration_cast<microseconds>(steady_clock::now() - start).count() * 1e-3;
+
+    std::thread step{[&] { solver.update(dt); }};
+    QueryResults results;
+    const auto run = [&](auto&& batch) {
+        const auto batch_start = steady_clock::now();
+        batch();
+        const double seconds = duration_cast<nanoseconds>(steady_clock::now() - batch_start).count() * 1e-9;
+        std::ostringstream line;
+        line << std::fixed << std::setprecision(0) << options.queries / seconds << "/s (" << std::setprecision(1) << static_cast<double>(results.ids.size()) / options.queries << " balls each)";
+        return line.str();
+    };
+    const std::string radius = run([&] { queries.queryRadius(circles, results); });
+    const std::string box = run([&] { queries.queryBox(boxes, results); });
+    const std::string knn = run([&] { queries.queryNearest(nearest, results); });
+    step.join();
+    std::cerr << "Queries on " << queries.ids.size() << " balls, copied in " << update_ms << " ms, run during a step: radius 3 " << radius << ", box 6x4 " << box << ", 8 nearest " << knn << "\n";
+}
+
+// Returns nothing when the scenario can't start from its snapshot
+std::optional<Result> runScenario(const Scenario& scenario, int frames, const Options& options) {
+    Result result;
+    resetPeakRSS();
+
+    std::mt19937 rng{options.seed};
+    PhysicsSolver solver{scenario.world_size, options.broadphase, options.threads};
+    solver.incremental_index = options.incremental_index;
+    solver.reorder_interval = options.reorder_interval;
+    solver.sleep_steps = options.sleep_steps;
+    solver.adaptive_sub_steps = options.adaptive_sub_steps;
+    solver.contact_solver = options.contact_solver;
+    solver.batched_narrowphase = options.batched_narrowphase;
+    if (options.solver_iterations > 0) {
+        solver.solver_iterations = options.solver_iterations;
+    }
+    solver.profiler.enabled = !options.profile_prefix.empty();
+    if (!options.load_prefix.empty()) {
+        const std::string path = options.load_prefix + "_" + scenario.name + ".snap";
+        const auto start = steady_clock::now();
+        if (!loadSnapshot(solver, path)) {
+            std::cerr << "Can't load " << path << "\n";
+            return std::nullopt;
+        }
+        std::cerr << "Loaded " << solver.particles.size() << " balls from " << path << " in " << duration_cast<microseconds>(steady_clock::now() - start).count() << " us\n";
+    } else {
+        const auto start = steady_clock::now();
+        scenario.setup(solver, rng);
+        result.setup_ns = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+    }
+
+    std::unique_ptr<TrajectoryRecorder> recorder;
+    const std::string record_path = options.record_prefix + "_" + scenario.name + ".traj";
+    if (!options.record_prefix.empty()) {
+        recorder = std::make_unique<TrajectoryRecorder>(record_path, solver.world_size);
+        if (!recorder->isOpen()) {
+            std::cerr << "Can't record to " << record_path << "\n";
+            return std::nullopt;
+        }
+    }
+    int64_t record_ns = 0;
+
+    const float dt = 1.0f / 60.0f;
+    for (int frame = 0; frame < frames; frame++) {
+        if (scenario.before_frame) {
+            scenario.before_frame(solver, frame);
+        }
+        const size_t allocations = allocation_count.load();
+        const auto start = steady_clock::now();
+        solver.update(dt);
+        result.physics_ns += duration_cast<nanoseconds>(steady_clock::now() - start).count();
+        result.allocations += allocation_count.load() - allocations;
+        solver.profiler.counter("allocations", allocation_count.load() - allocations);
+        result.collisions += solver.collision_count;
+        result.narrowphase_ns += solver.narrowphase_ns;
+        result.constraints_ns += solver.constraints_ns;
+        result.constraints += solver.constraint_count;
+        result.moved += solver.moved_count;
+        result.pairs += solver.pair_count * solver.sub_steps;
+        result.candidates += solver.candidate_count * solver.sub_steps;
+        result.contacts += static_cast<double>(solver.collision_count) / solver.solver_iterations;
+        result.pair_builds += solver.pair_builds;
+        result.sub_steps += solver.sub_steps;
+        if (recorder) {
+            const auto record_start = steady_clock::now();
+            recorder->record(solver);
+            record_ns += duration_cast<nanoseconds>(steady_clock::now() - record_start).count();
+        }
+    }
+    if (recorder) {
+        recorder->close();
+        std::cerr << "Recorded " << frames << " frames to " << record_path << ": " << recorder->getBytesWritten() / 1e6 << " MB, "
+                  << static_cast<double>(recorder->getBytesWritten()) / frames / std::max<size_t>(1, solver.particles.size()) << " bytes per ball and frame, "
+                  << 100.0 * record_ns / result.physics_ns << "% of the step time, " << recorder->stalled_frames << " frames waited for the writer\n";
+    }
+
+    result.objects = solver.particles.size();
+    result.sleeping = solver.sleeping_count;
+    result.links = solver.constraints.link_count;
+    result.frames = frames;
+    result.peak_rss_kb = readPeakRSS();
+    if (!options.save_prefix.empty()) {
+        const std::string path = options.save_prefix + "_" + scenario.name + ".snap";
+        const auto start = steady_clock::now();
+        if (saveSnapshot(solver, path)) {
+            std::cerr << "Saved " << solver.particles.size() << " balls to " << path << " in " << duration_cast<microseconds>(steady_clock::now() - start).count() << " us\n";
+        } else {
+            std::cerr << "Can't save " << path << "\n";
+        }
+    }
+    if (solver.profiler.enabled) {
+        writeProfile(solver.profiler, options.profile_prefix + "_" + scenario.name);
+    }
+    // In id order, so reordering the particles doesn't change the rounding
+    for (const int i : solver.particles.indices) {
+        if (i != -1) {
+            result.checksum += solver.particles.x[i] + solver.particles.y[i];
+            result.positions.push_back(solver.particles.getPosition(i));
+        }
+    }
+    if (options.queries > 0) {
+        runQueries(solver, rng, options, dt);
+    }
+    return result;
+}
+
+// Runs a scenario without per frame callback split over options.processes processes, each owning a vertical strip,
+// and compares the final positions with the ones of the single process run
+void runDecomposedScenario(const Scenario& scenario, int frames, const Options& options, const Result& reference) {
+    if (scenario.before_frame || !options.load_prefix.empty()) {
+        std::cout << "  " << scenario.name << " adds or removes balls while running, it can't be split over processes\n";
+        return;
+    }
+    // Objects in id order, so their global ids match the ids of the single process run
+    std::vector<PhysicsObject> objects;
+    DomainOptions domain_options;
+    {
+        std::mt19937 rng{options.seed};
+        PhysicsSolver solver{scenario.world_size, options.broadphase, 1};
+        scenario.setup(solver, rng);
+        const Particles& particles = solver.particles;
+        for (const int i : particles.indices) {
+            PhysicsObject& object = objects.emplace_back(particles.getPosition(i));
+            object.last_position = particles.getLastPosition(i);
+            object.radius = particles.radius[i];
+        }
+        domain_options.gravity = solver.gravity;
+        domain_options.sub_steps = solver.sub_steps;
+    }
+    domain_options.workers = options.processes;
+    domain_options.frames = frames;
+    domain_options.broadphase = options.broadphase;
+    domain_options.threads = options.threads > 0 ? options.threads : std::max(1, static_cast<int>(std::thread::hardware_concurrency()) / options.processes);
+
+    std::cout.flush();
+    const std::optional<DomainResult> run = runDomains(scenario.world_size, objects, domain_options);
+    if (!run) {
+        std::cout << "  " << scenario.name << " can't run over " << options.processes << " processes\n";
+        return;
+    }
+    const DomainResult& result = *run;
+    double checksum = 0.0;
+    double distance = 0.0;
+    double largest = 0.0;
+    for (size_t id = 0; id < objects.size(); id++) {
+        checksum += result.x[id] + result.y[id];
+        const double dx = result.x[id] - reference.positions[id].x;
+        const double dy = result.y[id] - reference.positions[id].y;
+        distance += std::sqrt(dx * dx + dy * dy);
+        largest = std::max(largest, std::sqrt(dx * dx + dy * dy));
+    }
+    int64_t exchange_ns = 0;
+    int64_t migrations = 0;
+    int ghosts = 0;
+    for (const DomainWorkerStats& worker : result.workers) {
+        exchange_ns = std::max(exchange_ns, worker.exchange_ns);
+        migrations += worker.migrations;
+        ghosts += worker.ghosts;
+    }
+    const int sub_steps = frames * domain_options.sub_steps;
+    std::cout << "  " << scenario.name << " over " << options.processes << " processes: " << std::setprecision(0) << static_cast<double>(result.physics_ns) / sub_steps << " ns/substep ("
+              << std::setprecision(2) << reference.physics_ns / result.physics_ns << "x), " << std::setprecision(0) << static_cast<double>(exchange_ns) / sub_steps << " ns/substep exchanging, "
+              << ghosts / options.processes << " ghosts/process, " << migrations << " migrations, " << (result.consistent ? "every ball owned once" : "BALLS LOST OR DUPLICATED") << ", checksum "
+              << std::setprecision(3) << checksum << " (" << std::setprecision(6) << (checksum - reference.checksum) / reference.checksum * 100.0 << "%), distance to the single process run mean "
+              << std::setprecision(3) << distance / objects.size() << " max " << largest << "\n";
+}
+
+void printUsage(const std::vector<Scenario>& scenarios) {
+    std::cout << "Usage: VerletBench [--frames N] [--seed S] [--broadphase quadtree|grid|multigrid] [--threads N] [--rebuild-index] [--reorder K] [--sleep STEPS] [--adaptive] [--jacobi] [--iterations N] [--scalar-narrowphase] [--processes N] [--queries N] [--profile PREFIX] [--save PREFIX] [--load PREFIX] [--record PREFIX] [scenario...]\n";
+    std::cout << "Scenarios:";
+    for (const auto& scenario : scenarios) {
+        std::cout << " " << scenario.name;
+    }
+    std::cout << "\n";
+}
+
+int main(int argc, char** argv) {
+    const std::vector<Scenario> scenarios = makeScenarios();
+    std::vector<std::string> selected;
+    int frames_override = 0;
+    Options options;
+
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            frames_override = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            options.seed = static_cast<unsigned>(std::atol(argv[++i]));
+        } else if (std::strcmp(argv[i], "--broadphase") == 0 && i + 1 < argc) {
+            const char* name = argv[++i];
+            options.broadphase = std::strcmp(name, "grid") == 0 ? Broadphase::Grid : std::strcmp(name, "multigrid") == 0 ? Broadphase::MultiGrid : Broadphase::QuadTree;
+        } else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            options.threads = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--rebuild-index") == 0) {
+            options.incremental_index = false;
+        } else if (std::strcmp(argv[i], "--reorder") == 0 && i + 1 < argc) {
+            options.reorder_interval = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--sleep") == 0 && i + 1 < argc) {
+            options.sleep_steps = std::clamp(std::atoi(argv[++i]), 0, 255);
+        } else if (std::strcmp(argv[i], "--adaptive") == 0) {
+            options.adaptive_sub_steps = true;
+        } else if (std::strcmp(argv[i], "--jacobi") == 0) {
+            options.contact_solver = ContactSolver::Jacobi;
+        } else if (std::strcmp(argv[i], "--scalar-narrowphase") == 0) {
+            options.batched_narrowphase = false;
+        } else if (std::strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            options.solver_iterations = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "--processes") == 0 && i + 1 < argc) {
+            options.processes = std::max(0, std::atoi(argv[++i]));
+        } else if (std::strcmp(argv[i], "--queries") == 0 && i + 1 < argc) {
+            options.queries = std::max(0, std::atoi(argv[++i]));
+        } else if (std::strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            options.profile_prefix = argv[++i];
+        } else if (std::strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+            options.save_prefix = argv[++i];
+        } else if (std::strcmp(argv[i], "--load") == 0 && i + 1 < argc) {
+            options.load_prefix = argv[++i];
+        } else if (std::strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            options.record_prefix = argv[++i];
+        } else if (std::strcmp(argv[i], "--help") == 0) {
+            printUsage(scenarios);
+            return 0;
+        } else {
+            selected.emplace_back(argv[i]);
+        }
+    }
+
+    std::cout << std::left << std::setw(12) << "scenario" << std::right << std::setw(10) << "balls" << std::setw(10) << "asleep" << std::setw(8) << "frames" << std::setw(10) << "setup ms" << std::setw(16) << "substeps/frame" << std::setw(14) << "ns/substep" << std::setw(16) << "collisions/s" << std::setw(19) << "narrow contacts/s" << std::setw(9) << "links" << std::setw(16) << "constraints/s"
+              << std::setw(12) << "pairs/step" << std::setw(17) << "candidates/step" << std::setw(15) << "contacts/step" << std::setw(13) << "builds/frame" << std::setw(12) << "moved/step" << std::setw(13) << "allocs/frame" << std::setw(12) << "peak MB" << std::setw(18) << "checksum" << "\n";
+
+    int ran = 0;
+    for (const auto& scenario : scenarios) {
+        if (!selected.empty() && std::find(selected.begin(), selected.end(), scenario.name) == selected.end()) {
+            continue;
+        }
+        const int frames = frames_override > 0 ? frames_override : scenario.frames;
+        const std::optional<Result> run = runScenario(scenario, frames, options);
+        if (!run) {
+            return 1;
+        }
+        const Result& result = *run;
+        const double seconds = result.physics_ns * 1e-9;
+
+        std::cout << std::left << std::setw(12) << scenario.name << std::right << std::setw(10) << result.objects << std::setw(10) << result.sleeping << std::setw(8) << result.frames << std::setw(10) << std::fixed
+                  << std::setprecision(1) << result.setup_ns * 1e-6 << std::setw(16) << std::setprecision(2) << static_cast<double>(result.sub_steps) / result.frames << std::setw(14) << std::setprecision(0) << result.physics_ns / result.sub_steps << std::setw(16) << std::setprecision(0) << result.collisions / seconds
+                  << std::setw(19) << result.collisions / (result.narrowphase_ns * 1e-9) << std::setw(9) << result.links << std::setw(16) << (result.constraints > 0 ? result.constraints / (result.constraints_ns * 1e-9) : 0.0) << std::setw(12)
+                  << static_cast<double>(result.pairs) / result.sub_steps << std::setw(17) << static_cast<double>(result.candidates) / result.sub_steps << std::setw(15) << result.contacts / result.sub_steps << std::setw(13) << std::setprecision(2) << static_cast<double>(result.pair_builds) / result.frames
+                  << std::setw(12) << std::setprecision(0) << static_cast<double>(result.moved) / result.sub_steps << std::setw(13) << std::setprecision(1) << static_cast<double>(result.allocations) / result.frames
+                  << std::setw(12) << result.peak_rss_kb / 1024.0 << std::setw(18) << std::setprecision(3) << result.checksum << std::endl;
+        if (options.processes > 0) {
+            runDecomposedScenario(scenario, frames, options, result);
+        }
+        ran++;
+    }
+
+    if (ran == 0) {
+        printUsage(scenarios);
+        return 1;
+    }
+}
@@ -0,0 +1,140 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "engine/physics/physics.hpp"
+#include "engine/physics/snapshot.hpp"
+
+using namespace std::chrono;
+
+// Regression checks of behaviours the benchmark numbers can't show, run by ctest through VerletChecks.
+// Every check returns an empty string when it passes, what went wrong otherwise.
+struct Check {
+    std::string name;
+    std::function<std::string()> run;
+};
+
+// Formats the values of a failure message
+template <typename... Args>
+std::string describe(const Args&... args) {
+    std::ostringstream stream;
+    (stream << ... << args);
+    return stream.str();
+}
+
+// Packs count balls of radius 0.5 in a hexagonal lattice from the bottom of the world upwards
+void fillPile(PhysicsSolver& solver, int count) {
+    const float margin = 1.0f;
+    const float row_height = std::sqrt(3.0f) * 0.5f;
+    for (int row = 0; count > 0; row++) {
+        const float y = solver.world_size.y - margin - row * row_height;
+        if (y < margin) {
+            break;
+        }
+        for (float x = margin + ((row & 1) ? 0.5f : 0.0f); x <= solver.world_size.x - margin && count > 0; x += 1.0f) {
+            solver.createObject({x, y});
+            count--;
+        }
+    }
+}
+
+// Once a pile has settled, the adaptive substep count must stop moving
+std::string checkAdaptiveSettledPile() {
+    PhysicsSolver solver{{150.0f, 150.0f}, Broadphase::Grid, 1};
+    solver.adaptive_sub_steps = true;
+    fillPile(solver, 24000);
+    int lowest = solver.max_sub_steps;
+    int highest = solver.min_sub_steps;
+    int raises = 0;
+    for (int frame = 0; frame < 900; frame++) {
+        const int previous = solver.sub_steps;
+        solver.update(1.0f / 60.0f);
+        if (frame >= 300) {
+            lowest = std::min(lowest, solver.sub_steps);
+            highest = std::max(highest, solver.sub_steps);
+            raises += solver.sub_steps > previous;
+        }
+    }
+    if (raises > 0 || highest - lowest > 2) {
+        return describe("substeps went from ", lowest, " to ", highest, " with ", raises, " raises over the last 600 frames");
+    }
+    return {};
+}
+
+// A run saved and loaded half way must end exactly where the same run without the round trip does
+std::string checkSnapshotContinuation(bool batched) {
+    const auto makeSolver = [&] {
+        auto solver = std::make_unique<PhysicsSolver>(Vec2{150.0f, 150.0f}, Broadphase::Grid, 8);
+        solver->batched_narrowphase = batched;
+        return solver;
+    };
+    const auto straight_solver = makeSolver();
+    const auto saved_solver = makeSolver();
+    const auto loaded_solver = makeSolver();
+    PhysicsSolver& straight = *straight_solver;
+    PhysicsSolver& saved = *saved_solver;
+    PhysicsSolver& loaded = *loaded_solver;
+    fillPile(straight, 24000);
+    fillPile(saved, 24000);
+    for (int frame = 0; frame < 200; frame++) {
+        straight.update(1.0f / 60.0f);
+        saved.update(1.0f / 60.0f);
+    }
+    const std::string path = "verlet_checks_continuation.snapshot";
+    const bool round_trip = saveSnapshot(saved, path) && loadSnapshot(loaded, path);
+    std::remove(path.c_str());
+    if (!round_trip) {
+        return "snapshot round trip failed";
+    }
+    for (int frame = 0; frame < 50; frame++) {
+        straight.update(1.0f / 60.0f);
+        loaded.update(1.0f / 60.0f);
+    }
+    const size_t bytes = straight.particles.size() * sizeof(float);
+    for (size_t i = 0; i < straight.particles.size(); i++) {
+        if (std::memcmp(&straight.particles.x[i], &loaded.particles.x[i], sizeof(float)) != 0 ||
+            std::memcmp(&straight.particles.y[i], &loaded.particles.y[i], sizeof(float)) != 0) {
+            return describe("ball ", i, " is at (", loaded.particles.x[i], ", ", loaded.particles.y[i], ") after loading instead of (",
+                            straight.particles.x[i], ", ", straight.particles.y[i], ")");
+        }
+    }
+    if (std::memcmp(straight.particles.last_x.data(), loaded.particles.last_x.data(), bytes) != 0 ||
+        std::memcmp(straight.particles.last_y.data(), loaded.particles.last_y.data(), bytes) != 0) {
+        return "velocities differ after loading";
+    }
+    return {};
+}
+
+int main(int argc, char* argv[]) {
+    const std::vector<Check> checks = {
+        {"adaptive_settled_pile", checkAdaptiveSettledPile},
+        {"snapshot_continuation_batched", [] { return checkSnapshotContinuation(true); }},
+        {"snapshot_continuation_scalar", [] { return checkSnapshotContinuation(false); }},
+    };
+
+    // Checks named on the command line, every check when none is
+    int failed = 0;
+    for (const Check& check : checks) {
+        if (argc > 1 && std::none_of(argv + 1, argv + argc, [&](const char* name) { return check.name == name; })) {
+            continue;
+        }
+        const auto start = steady_clock::now();
+        const std::string error = check.run();
+        const double ms = duration<double, std::milli>(steady_clock::now() - start).count();
+        if (error.empty()) {
+            std::cout << "PASS " << check.name << " (" << static_cast<int>(ms) << " ms)" << std::endl;
+        } else {
+            std::cout << "FAIL " << check.name << ": " << error << std::endl;
+            failed++;
+        }
+    }
+    return failed;
+}
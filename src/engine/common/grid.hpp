@@ -0,0 +1,181 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "engine/common/quadtree.hpp"
+#include "engine/common/thread_pool.hpp"
+#include "engine/common/vec.hpp"
+
+// Flat uniform grid rebuilt with a counting sort, objects of the same cell are contiguous in memory
+struct UniformGrid {
+    std::vector<QuadObject> objects;  // stores all objects, sorted by cell once build() is called
+    std::vector<int> cell_start;      // index of the first object of each cell, last entry is the object count
+    std::vector<int> object_cells;    // cell of each inserted object, -1 when outside of the grid
+    std::vector<int> object_slots;    // index in objects of each object inserted by the parallel build, -1 when outside of the grid
+    std::vector<int> worker_moved;    // objects that changed cell, counted by each worker
+    std::vector<QuadObject> sorted;   // scratch buffer for the counting sort
+    Vec2 size;                        // size of the covered area, starting at (0, 0)
+    float cell_size;                  // width and height of a cell
+    int width;                        // number of cells along x
+    int height;                       // number of cells along y
+
+    UniformGrid(const Vec2& _size, float _cell_size = 1.0f)
+        : size{_size}, cell_size{_cell_size}, width{std::max(1, static_cast<int>(_size.x / _cell_size) + 1)}, height{std::max(1, static_cast<int>(_size.y / _cell_size) + 1)} {
+        cell_start.assign(width * height + 1, 0);
+    }
+
+    int getCellX(float x) const {
+        return std::clamp(static_cast<int>(x / cell_size), 0, width - 1);
+    }
+
+    int getCellY(float y) const {
+        return std::clamp(static_cast<int>(y / cell_size), 0, height - 1);
+    }
+
+    int getCell(const Vec2& position) const {
+        return getCellY(position.y) * width + getCellX(position.x);
+    }
+
+    void insert(const Vec2& position, const int id) {
+        objects.emplace_back(position, id);
+    }
+
+    // Sorts the inserted objects by cell, must be called before querying
+    void build() {
+        const int cells = width * height;
+        cell_start.assign(cells + 1, 0);
+        object_cells.resize(objects.size());
+        for (size_t i = 0; i < objects.size(); i++) {
+            const int cell = getCell(objects[i].position);
+            object_cells[i] = cell;
+            cell_start[cell + 1]++;
+        }
+        for (int i = 0; i < cells; i++) {
+            cell_start[i + 1] += cell_start[i];
+        }
+
+        sorted.resize(objects.size());
+        for (size_t i = 0; i < objects.size(); i++) {
+            sorted[cell_start[object_cells[i]]++] = objects[i];
+        }
+        // Every start was moved to the end of its cell, shift them back
+        for (int i = cells; i > 0; i--) {
+            cell_start[i] = cell_start[i - 1];
+        }
+        cell_start[0] = 0;
+        objects.swap(sorted);
+    }
+
+    // Rebuilds the grid straight from position arrays using every worker of the pool, objects outside the grid are skipped.
+    // Objects of a cell are stored in no particular order, callers sort the query results when the order matters.
+    void build(const float* x, const float* y, int count, ThreadPool& pool) {
+        const int cells = width * height;
+        cell_start.assign(cells + 1, 0);
+        object_cells.resize(count);
+        pool.parallelFor(count, [&](int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                if (x[i] > 0.0f && x[i] < size.x && y[i] > 0.0f && y[i] < size.y) {
+                    const int cell = getCell({x[i], y[i]});
+                    object_cells[i] = cell;
+                    std::atomic_ref<int>{cell_start[cell + 1]}.fetch_add(1, std::memory_order_relaxed);
+                } else {
+                    object_cells[i] = -1;
+                }
+            }
+        });
+        for (int i = 0; i < cells; i++) {
+            cell_start[i + 1] += cell_start[i];
+        }
+
+        objects.resize(cell_start[cells]);
+        object_slots.resize(count);
+        pool.parallelFor(count, [&](int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                const int cell = object_cells[i];
+                if (cell != -1) {
+                    const int slot = std::atomic_ref<int>{cell_start[cell]}.fetch_add(1, std::memory_order_relaxed);
+                    objects[slot] = QuadObject{{x[i], y[i]}, i};
+                    object_slots[i] = slot;
+                } else {
+                    object_slots[i] = -1;
+                }
+            }
+        });
+        // Every start was moved to the end of its cell, shift them back
+        for (int i = cells; i > 0; i--) {
+            cell_start[i] = cell_start[i - 1];
+        }
+        cell_start[0] = 0;
+    }
+
+    // Refreshes the stored positions when no object changed cell since the last build, rebuilds the grid otherwise.
+    // Returns the number of objects that changed cell, new objects included.
+    int update(const float* x, const float* y, int count, ThreadPool& pool) {
+        const int known = std::min<int>(count, object_slots.size());
+        worker_moved.assign(pool.size(), 0);
+        pool.parallelFor(known, [&](int begin, int end, int worker) {
+            int moved = 0;
+            for (int i = begin; i < end; i++) {
+                const bool inside = x[i] > 0.0f && x[i] < size.x && y[i] > 0.0f && y[i] < size.y;
+                const int cell = inside ? getCell({x[i], y[i]}) : -1;
+                if (cell != object_cells[i]) {
+                    moved++;
+                } else if (cell != -1) {
+                    objects[object_slots[i]].position = {x[i], y[i]};
+                }
+            }
+            worker_moved[worker] = moved;
+        });
+
+        int moved = count - known;
+        for (const int worker_count : worker_moved) {
+            moved += worker_count;
+        }
+        if (moved > 0) {
+            build(x, y, count, pool);
+        }
+        return moved;
+    }
+
+    void clear() {
+        objects.clear();
+        object_cells.clear();
+        object_slots.clear();
+        std::fill(cell_start.begin(), cell_start.end(), 0);
+    }
+
+    // Calls visit(id) for every object inside bounds, without allocating
+    template <typename Bound, typename Visitor>
+    void forEach(const Bound& bounds, Visitor&& visit) const {
+        const QuadCell area = bounds.getBounds();
+        const int min_x = getCellX(area.position.x - area.half_size.x);
+        const int max_x = getCellX(area.position.x + area.half_size.x);
+        const int min_y = getCellY(area.position.y - area.half_size.y);
+        const int max_y = getCellY(area.position.y + area.half_size.y);
+        for (int y = min_y; y <= max_y; y++) {
+            // Cells of a row are contiguous, so the whole row span is a single range
+            const int row = y * width;
+            for (int i = cell_start[row + min_x]; i < cell_start[row + max_x + 1]; i++) {
+                const QuadObject& obj = objects[i];
+                if (bounds.contains(obj)) {
+                    visit(obj.id);
+                }
+            }
+        }
+    }
+
+    // Replaces the content of result with the ids of the objects inside bounds, reusing its memory
+    template <typename Bound>
+    void query(const Bound& bounds, std::vector<int>& result) const {
+        result.clear();
+        forEach(bounds, [&](int id) { result.emplace_back(id); });
+    }
+
+    template <typename Bound>
+    std::vector<int> query(const Bound& bounds) const {
+        std::vector<int> result;
+        query(bounds, result);
+        return result;
+    }
+};
@@ -0,0 +1,17 @@
+#pragma once
+#include <cstdint>
+
+// Spreads the 16 low bits of v so there is a zero bit between each of them
+inline uint32_t spreadBits(uint32_t v) {
+    v &= 0x0000ffff;
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+// Z-order curve index of a cell, cells close in space get close codes
+inline uint32_t mortonCode(uint32_t x, uint32_t y) {
+    return spreadBits(x) | (spreadBits(y) << 1);
+}
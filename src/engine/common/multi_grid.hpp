@@ -0,0 +1,62 @@
+#pragma once
+#include <algorithm>
+#include <vector>
+
+#include "engine/common/grid.hpp"
+#include "engine/common/quadtree.hpp"
+#include "engine/common/vec.hpp"
+
+// Uniform grids of growing cell sizes, each object stored in the level whose cells fit its diameter. A query visits
+// every level with its reach grown by the largest radius of that level only, so small objects never search as far as
+// the biggest ones and big objects never scan the fine cells one by one.
+struct MultiLevelGrid {
+    std::vector<UniformGrid> levels;  // level k has cells of base_cell * 2^k
+    std::vector<float> level_radius;  // largest radius stored in each level, 0 when empty
+    Vec2 size;
+    float base_cell;
+
+    MultiLevelGrid(const Vec2& _size, float _base_cell = 1.0f) : size{_size}, base_cell{_base_cell} {}
+
+    // Smallest level whose cells are at least as wide as the object
+    int getLevel(float radius) const {
+        int level = 0;
+        for (float cell = base_cell; cell < 2.0f * radius; cell *= 2.0f) {
+            level++;
+        }
+        return level;
+    }
+
+    void insert(const Vec2& position, float radius, int id) {
+        const int level = getLevel(radius);
+        while (static_cast<int>(levels.size()) <= level) {
+            levels.emplace_back(size, base_cell * static_cast<float>(1 << levels.size()));
+            level_radius.push_back(0.0f);
+        }
+        levels[level].insert(position, id);
+        level_radius[level] = std::max(level_radius[level], radius);
+    }
+
+    // Sorts the objects of every level by cell, must be called before querying
+    void build() {
+        for (UniformGrid& level : levels) {
+            level.build();
+        }
+    }
+
+    void clear() {
+        for (UniformGrid& level : levels) {
+            level.clear();
+        }
+        std::fill(level_radius.begin(), level_radius.end(), 0.0f);
+    }
+
+    // Calls visit(id) for every object whose center is closer than reach plus the largest radius of its level
+    template <typename Visitor>
+    void forEach(const Vec2& position, float reach, Visitor&& visit) const {
+        for (size_t level = 0; level < levels.size(); level++) {
+            if (level_radius[level] > 0.0f) {
+                levels[level].forEach(QueryCircle{position, reach + level_radius[level]}, visit);
+            }
+        }
+    }
+};
@@ -0,0 +1,183 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string_view>
+#include <tuple>
+#include <vector>
+
+// Time span of a phase run by one worker
+struct ProfileEvent {
+    const char* name;  // static string
+    int frame;
+    int worker;
+    int arg;           // tile the phase worked on, -1 when the phase covers no tile
+    int64_t start_ns;  // since the profiler was created
+    int64_t end_ns;
+};
+
+// Value sampled once per frame
+struct ProfileCounter {
+    const char* name;  // static string
+    int frame;
+    int64_t time_ns;
+    double value;
+};
+
+// Collects phase timings and counters frame by frame. Every worker appends to its own buffer, so recording needs no lock.
+// Nothing is recorded while enabled is false, buffers keep growing while it's true until clear() is called.
+struct Profiler {
+    bool enabled = false;
+    int frame = -1;  // frame started by the last beginFrame()
+    std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+    std::vector<std::vector<ProfileEvent>> worker_events;  // events of each worker, only written by that worker
+    std::vector<ProfileCounter> counters;                  // only written by the thread driving the frames
+
+    explicit Profiler(int workers = 1) : worker_events(workers) {}
+
+    int64_t now() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+    }
+
+    void beginFrame() {
+        frame++;
+    }
+
+    void record(const char* name, int worker, int arg, int64_t start_ns, int64_t end_ns) {
+        worker_events[worker].push_back({name, frame, worker, arg, start_ns, end_ns});
+    }
+
+    void counter(const char* name, double value) {
+        if (enabled) {
+            counters.push_back({name, frame, now(), value});
+        }
+    }
+
+    void clear() {
+        for (auto& events : worker_events) {
+            events.clear();
+        }
+        counters.clear();
+    }
+
+    // One row per frame, phase and worker with the summed time, then one row per counter
+    void writeCsv(std::ostream& out) const {
+        out << "frame,type,name,worker,calls,value\n";
+        for (const PhaseTotal& total : getPhaseTotals()) {
+            out << total.frame << ",time_us," << total.name << "," << total.worker << "," << total.calls << "," << total.ns * 1e-3 << "\n";
+        }
+        for (const ProfileCounter& counter : counters) {
+            out << counter.frame << ",counter," << counter.name << ",,1," << counter.value << "\n";
+        }
+    }
+
+    // An array of frames, each with the summed time of every phase and worker and its counters
+    void writeJson(std::ostream& out) const {
+        const std::vector<PhaseTotal> totals = getPhaseTotals();
+        int first_frame = frame + 1;
+        int last_frame = -1;
+        for (const PhaseTotal& total : totals) {
+            first_frame = std::min(first_frame, total.frame);
+            last_frame = std::max(last_frame, total.frame);
+        }
+        for (const ProfileCounter& counter : counters) {
+            first_frame = std::min(first_frame, counter.frame);
+            last_frame = std::max(last_frame, counter.frame);
+        }
+
+        out << "[";
+        auto total = totals.begin();
+        auto counter = counters.begin();
+        for (int f = first_frame; f <= last_frame; f++) {
+            out << (f == first_frame ? "\n" : ",\n") << "  {\"frame\": " << f << ", \"phases\": [";
+            for (bool first = true; total != totals.end() && total->frame == f; total++, first = false) {
+                out << (first ? "" : ", ") << "{\"name\": \"" << total->name << "\", \"worker\": " << total->worker << ", \"calls\": " << total->calls
+                    << ", \"us\": " << total->ns * 1e-3 << "}";
+            }
+            out << "], \"counters\": {";
+            for (bool first = true; counter != counters.end() && counter->frame == f; counter++, first = false) {
+                out << (first ? "" : ", ") << "\"" << counter->name << "\": " << counter->value;
+            }
+            out << "}}";
+        }
+        out << "\n]\n";
+    }
+
+    // Trace Event Format, opened by chrome://tracing or Perfetto, with one track per worker
+    void writeChromeTrace(std::ostream& out) const {
+        out << "{\"traceEvents\": [";
+        bool first = true;
+        for (const auto& events : worker_events) {
+            for (const ProfileEvent& event : events) {
+                out << (first ? "\n" : ",\n") << "{\"name\": \"" << event.name << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << event.worker << ", \"ts\": " << event.start_ns * 1e-3
+                    << ", \"dur\": " << (event.end_ns - event.start_ns) * 1e-3 << ", \"args\": {\"frame\": " << event.frame;
+                if (event.arg != -1) {
+                    out << ", \"tile\": " << event.arg;
+                }
+                out << "}}";
+                first = false;
+            }
+        }
+        for (const ProfileCounter& counter : counters) {
+            out << (first ? "\n" : ",\n") << "{\"name\": \"" << counter.name << "\", \"ph\": \"C\", \"pid\": 0, \"ts\": " << counter.time_ns * 1e-3 << ", \"args\": {\"value\": " << counter.value
+                << "}}";
+            first = false;
+        }
+        out << "\n]}\n";
+    }
+
+  private:
+    struct PhaseTotal {
+        int frame;
+        std::string_view name;
+        int worker;
+        int calls;
+        int64_t ns;
+    };
+
+    // Summed time of every phase per frame and worker, sorted by frame, name then worker
+    std::vector<PhaseTotal> getPhaseTotals() const {
+        std::vector<PhaseTotal> totals;
+        for (const auto& events : worker_events) {
+            for (const ProfileEvent& event : events) {
+                totals.push_back({event.frame, event.name, event.worker, 1, event.end_ns - event.start_ns});
+            }
+        }
+        const auto key = [](const PhaseTotal& total) { return std::tie(total.frame, total.name, total.worker); };
+        std::sort(totals.begin(), totals.end(), [&](const PhaseTotal& a, const PhaseTotal& b) { return key(a) < key(b); });
+
+        std::vector<PhaseTotal> merged;
+        for (const PhaseTotal& total : totals) {
+            if (!merged.empty() && key(merged.back()) == key(total)) {
+                merged.back().calls++;
+                merged.back().ns += total.ns;
+            } else {
+                merged.push_back(total);
+            }
+        }
+        return merged;
+    }
+};
+
+// Records the time between its construction and its destruction as an event of the worker
+struct ProfileScope {
+    Profiler& profiler;
+    const char* name;
+    int worker;
+    int arg;
+    bool active;
+    int64_t start_ns;
+
+    ProfileScope(Profiler& _profiler, const char* _name, int _worker = 0, int _arg = -1)
+        : profiler{_profiler}, name{_name}, worker{_worker}, arg{_arg}, active{_profiler.enabled}, start_ns{active ? _profiler.now() : 0} {}
+
+    ~ProfileScope() {
+        if (active) {
+            profiler.record(name, worker, arg, start_ns, profiler.now());
+        }
+    }
+
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+};
@@ -1,6 +1,9 @@
 #pragma once
+#include <algorithm>
+#include <cstdint>
 #include <vector>
 
+#include "engine/common/morton.hpp"
 #include "engine/common/vec.hpp"
 
 struct QuadObject {
@@ -18,24 +21,45 @@ struct QuadCell {
 
     QuadCell(const Vec2& pos, float width, float height) : position{pos}, half_size{width / 2, height / 2} {}
 
+    // Left and top edges are inside, right and bottom edges are outside, same as QuadTree::getQuadrant
     bool contains(const Vec2& point) const {
         float left = position.x - half_size.x;
         float right = position.x + half_size.x;
         float top = position.y - half_size.y;
         float bottom = position.y + half_size.y;
-        return left < point.x && right >= point.x && top < point.y && bottom >= point.y;
+        return left <= point.x && right > point.x && top <= point.y && bottom > point.y;
     }
     bool contains(const QuadObject& obj) const {
-        auto point = obj.position;
-        float left = position.x - half_size.x;
-        float right = position.x + half_size.x;
-        float top = position.y - half_size.y;
-        float bottom = position.y + half_size.y;
-        return left < point.x && right >= point.x && top < point.y && bottom >= point.y;
+        return contains(obj.position);
     }
-    bool intersects(QuadCell& a) const {
+    bool intersects(const QuadCell& a) const {
         return true;
     }
+    QuadCell getBounds() const {
+        return *this;
+    }
+};
+
+// Circular query area
+struct QueryCircle {
+    Vec2 position;
+    float radius;
+
+    bool contains(const QuadObject& obj) const {
+        const float dx = obj.position.x - position.x;
+        const float dy = obj.position.y - position.y;
+        return dx * dx + dy * dy < radius * radius;
+    }
+    bool intersects(const QuadCell& rect) const {
+        const float nearest_x = std::max(rect.position.x - rect.half_size.x, std::min(position.x, rect.position.x + rect.half_size.x));
+        const float nearest_y = std::max(rect.position.y - rect.half_size.y, std::min(position.y, rect.position.y + rect.half_size.y));
+        const float dx = nearest_x - position.x;
+        const float dy = nearest_y - position.y;
+        return dx * dx + dy * dy <= radius * radius;
+    }
+    QuadCell getBounds() const {
+        return QuadCell{position, 2.0f * radius, 2.0f * radius};
+    }
 };
 
 struct QuadNode {
@@ -48,6 +72,12 @@ struct QuadNode {
     QuadNode(const QuadCell& _area, int _depth) : area{_area}, first_child{-1}, count{0}, depth{_depth} {}
 };
 
+struct QuadTreeStats {
+    int nodes = 0;   // nodes reachable from the root, free ones excluded
+    int leaves = 0;
+    int depth = 0;   // depth of the deepest leaf
+};
+
 struct QuadTree {
     std::vector<QuadObject> objects;  // stores all object of the quadtree
     std::vector<QuadNode> nodes;      // childs of the quadtree (root is always at index 0)
@@ -55,17 +85,24 @@ struct QuadTree {
     const int max_obj = 8;            // max number of objects allowed in each cell before subdividing
     const int max_depth = 4;          // how deep the tree can grow
     int free_node = -1;
+    std::vector<int> scratch;  // reused by updateLeafs and cleanup
+    std::vector<uint64_t> insert_keys;  // reused by the batch insert
 
     QuadTree(const QuadCell& bounds) : root_bounds{bounds} {
-        nodes.reserve(1 + max_depth * max_depth * max_depth * max_depth);
+        nodes.reserve(getMaxNodes());
         nodes.emplace_back(QuadNode{root_bounds, 0});  // root node
     }
 
     QuadTree(const Vec2& size) : root_bounds{size / 2.0f, size.x, size.y} {
-        nodes.reserve(1 + max_depth * max_depth * max_depth * max_depth);
+        nodes.reserve(getMaxNodes());
         nodes.emplace_back(QuadNode{root_bounds, 0});  // root node
     }
 
+    // Number of nodes of a complete tree, 1 + 4 + 16 + ... + 4^max_depth
+    int getMaxNodes() const {
+        return ((1 << (2 * (max_depth + 1))) - 1) / 3;
+    }
+
     int getQuadrant(const QuadCell& area, const QuadObject& obj) const {
         const float cx = area.position.x;
         const float cy = area.position.y;
@@ -85,20 +122,22 @@ struct QuadTree {
         }
     }
 
-    void splitNode(QuadNode& node) {
-        const QuadCell& area = node.area;
+    void splitNode(int node_index) {
+        // Copied, nodes may be reallocated below
+        const QuadCell area = nodes[node_index].area;
+        const int depth = nodes[node_index].depth;
         const Vec2& current_pos = area.position;
         const Vec2& new_half_size = area.half_size / 2.0f;
         int childs_index = -1;
 
         QuadNode new_nodes[4] = {// Upper left
-                                 QuadNode{QuadCell{{current_pos.x - new_half_size.x, current_pos.y - new_half_size.y}, area.half_size.x, area.half_size.y}, node.depth + 1},
+                                 QuadNode{QuadCell{{current_pos.x - new_half_size.x, current_pos.y - new_half_size.y}, area.half_size.x, area.half_size.y}, depth + 1},
                                  // Lower left
-                                 QuadNode{QuadCell{{current_pos.x + new_half_size.x, current_pos.y - new_half_size.y}, area.half_size.x, area.half_size.y}, node.depth + 1},
+                                 QuadNode{QuadCell{{current_pos.x + new_half_size.x, current_pos.y - new_half_size.y}, area.half_size.x, area.half_size.y}, depth + 1},
                                  // Upper right
-                                 QuadNode{QuadCell{{current_pos.x - new_half_size.x, current_pos.y + new_half_size.y}, area.half_size.x, area.half_size.y}, node.depth + 1},
+                                 QuadNode{QuadCell{{current_pos.x - new_half_size.x, current_pos.y + new_half_size.y}, area.half_size.x, area.half_size.y}, depth + 1},
                                  // Lower right
-                                 QuadNode{QuadCell{{current_pos.x + new_half_size.x, current_pos.y + new_half_size.y}, area.half_size.x, area.half_size.y}, node.depth + 1}};
+                                 QuadNode{QuadCell{{current_pos.x + new_half_size.x, current_pos.y + new_half_size.y}, area.half_size.x, area.half_size.y}, depth + 1}};
 
         if (free_node != -1) {
             childs_index = free_node;
@@ -115,6 +154,7 @@ struct QuadTree {
             nodes.emplace_back(new_nodes[3]);
         }
 
+        QuadNode& node = nodes[node_index];
         int object_index = node.first_child;
         while (object_index != -1) {
             QuadObject& obj = objects[object_index];
@@ -137,16 +177,46 @@ struct QuadTree {
     }
 
     void insert(const Vec2& position, const int id) {
+        objects.emplace_back(position, id);
+        insertObject(objects.size() - 1);
+    }
+
+    // Inserts the points [begin, end) of the position arrays with their index as id, in a single pass along a Morton curve
+    // so consecutive insertions walk the same branches
+    void insert(const float* x, const float* y, int begin, int end) {
+        const float left = root_bounds.position.x - root_bounds.half_size.x;
+        const float top = root_bounds.position.y - root_bounds.half_size.y;
+        const float scale_x = 65535.0f / (2.0f * root_bounds.half_size.x);
+        const float scale_y = 65535.0f / (2.0f * root_bounds.half_size.y);
+        insert_keys.resize(end - begin);
+        for (int i = begin; i < end; i++) {
+            const uint32_t cell_x = std::clamp(static_cast<int>((x[i] - left) * scale_x), 0, 0xffff);
+            const uint32_t cell_y = std::clamp(static_cast<int>((y[i] - top) * scale_y), 0, 0xffff);
+            insert_keys[i - begin] = (static_cast<uint64_t>(mortonCode(cell_x, cell_y)) << 32) | static_cast<uint32_t>(i);
+        }
+        std::sort(insert_keys.begin(), insert_keys.end());
+
+        // Grows geometrically, small batches arrive every frame
+        const size_t needed = objects.size() + insert_keys.size();
+        if (objects.capacity() < needed) {
+            objects.reserve(std::max(needed, 2 * objects.capacity()));
+        }
+        for (const uint64_t key : insert_keys) {
+            const int i = static_cast<uint32_t>(key);
+            insert({x[i], y[i]}, i);
+        }
+    }
+
+    // Links an object already stored in objects into the leaf containing its position
+    void insertObject(int object_index) {
         int node_index = 0;
-        QuadObject object{position, id};
-        int object_index = objects.size();
-        objects.push_back(object);
+        const QuadObject object = objects[object_index];
         while (nodes[node_index].count == -1) {
             int quadrant = getQuadrant(nodes[node_index].area, object);
             node_index = nodes[node_index].first_child + quadrant;
         }
         if (nodes[node_index].count >= max_obj && nodes[node_index].depth < max_depth) {
-            splitNode(nodes[node_index]);
+            splitNode(node_index);
             int quadrant = getQuadrant(nodes[node_index].area, object);
             node_index = nodes[node_index].first_child + quadrant;
         }
@@ -161,8 +231,11 @@ struct QuadTree {
         node.count++;
     }
 
-    void updateLeafs() {
-        std::vector<int> to_reinsert;
+    // Moves the objects that left their leaf, their positions must already be updated in objects.
+    // Returns the number of moved objects.
+    int updateLeafs() {
+        std::vector<int>& to_reinsert = scratch;
+        to_reinsert.clear();
 
         for (auto& node : nodes) {
             if (node.count <= 0) {
@@ -188,35 +261,39 @@ struct QuadTree {
         }
 
         for (const auto i : to_reinsert) {
-            const Vec2 position = objects[i].position;
-            const int id = objects[i].id;
-            // objects.erase(i);
-            insert(position, id);
+            insertObject(i);
         }
+        return to_reinsert.size();
     }
 
+    // Collapses branches whose children are all empty leaves
     void cleanup() {
-        std::vector<int> to_process;
+        std::vector<int>& to_process = scratch;
+        to_process.clear();
 
         if (nodes[0].count == -1) {
             to_process.emplace_back(0);
         }
 
-        while (to_process.size() > 0) {
-            const int node_index = to_process.back();
-            QuadNode& node = nodes[node_index];
-            to_process.pop_back();
+        // Collect every branch, parents are always before their children
+        for (size_t i = 0; i < to_process.size(); i++) {
+            const QuadNode& node = nodes[to_process[i]];
+            for (int j = 0; j < 4; j++) {
+                if (nodes[node.first_child + j].count == -1) {
+                    to_process.emplace_back(node.first_child + j);
+                }
+            }
+        }
+
+        // Children first, so a whole empty subtree collapses in a single call
+        for (auto it = to_process.rbegin(); it != to_process.rend(); it++) {
+            QuadNode& node = nodes[*it];
 
             int empty_leaves = 0;
 
             for (int i = 0; i < 4; i++) {
-                const int child_index = node.first_child + i;
-                const QuadNode& child = nodes[child_index];
-
-                if (child.count == 0) {
+                if (nodes[node.first_child + i].count == 0) {
                     empty_leaves++;
-                } else if (child.count == -1) {
-                    to_process.emplace_back(child_index);
                 }
             }
 
@@ -232,19 +309,51 @@ struct QuadTree {
     void clear() {
         objects.clear();
         nodes.clear();
+        free_node = -1;
         nodes.emplace_back(QuadNode{root_bounds, 0});
     }
 
+    // Calls visit(id) for every object inside bounds, without allocating
+    template <typename Bound, typename Visitor>
+    void forEach(const Bound& bounds, Visitor&& visit) const {
+        forEach(bounds, visit, 0);
+    }
+
+    // Replaces the content of result with the ids of the objects inside bounds, reusing its memory
+    template <typename Bound>
+    void query(const Bound& bounds, std::vector<int>& result) const {
+        result.clear();
+        forEach(bounds, [&](int id) { result.emplace_back(id); });
+    }
+
     template <typename Bound>
-    std::vector<int> query(const Bound& bounds) {
+    std::vector<int> query(const Bound& bounds) const {
         std::vector<int> result;
-        query(bounds, result, 0);
+        query(bounds, result);
         return result;
     }
 
+    QuadTreeStats getStats() const {
+        QuadTreeStats stats;
+        collectStats(0, stats);
+        return stats;
+    }
+
   private:
-    template <typename Bound>
-    void query(const Bound& bounds, std::vector<int>& result, int idx) {
+    void collectStats(int idx, QuadTreeStats& stats) const {
+        stats.nodes++;
+        if (nodes[idx].count == -1) {
+            for (int i = 0; i < 4; i++) {
+                collectStats(nodes[idx].first_child + i, stats);
+            }
+        } else {
+            stats.leaves++;
+            stats.depth = std::max(stats.depth, nodes[idx].depth);
+        }
+    }
+
+    template <typename Bound, typename Visitor>
+    void forEach(const Bound& bounds, Visitor& visit, int idx) const {
         if (!bounds.intersects(nodes[idx].area)) {
             return;
         }
@@ -252,14 +361,14 @@ struct QuadTree {
         if (nodes[idx].count == -1) {
             for (int i = 0; i < 4; i++) {
                 const int index = nodes[idx].first_child + i;
-                query(bounds, result, index);
+                forEach(bounds, visit, index);
             }
         } else if (nodes[idx].count > 0) {
             int next = nodes[idx].first_child;
             while (next != -1) {
                 const QuadObject& obj = objects[next];
                 if (bounds.contains(obj)) {
-                    result.emplace_back(next);
+                    visit(obj.id);
                 }
                 next = obj.next;
             }
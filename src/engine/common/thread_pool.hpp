@@ -0,0 +1,126 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Long lived worker threads running one phase at a time. Every phase ends with a barrier, so the
+// next one can rely on the results of the previous one. The calling thread takes part as worker 0.
+// Phases can't be nested: a task must not start another phase on the same pool.
+struct ThreadPool {
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable start_condition;
+    std::condition_variable done_condition;
+    void (*task)(void*, int) = nullptr;  // type erased phase, called with the worker index
+    void* task_data = nullptr;
+    uint64_t generation = 0;  // incremented when a phase starts
+    int running = 0;          // workers that did not finish the current phase yet
+    bool stopping = false;
+
+    // A count of 0 uses one worker per hardware thread
+    explicit ThreadPool(int count = 0) {
+        if (count <= 0) {
+            count = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+        }
+        for (int i = 1; i < count; i++) {
+            threads.emplace_back([this, i] { workerLoop(i); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard lock{mutex};
+            stopping = true;
+        }
+        start_condition.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const {
+        return threads.size() + 1;
+    }
+
+    // Calls fn(worker) once on every worker and returns when all of them are done
+    template <typename Fn>
+    void run(Fn&& fn) {
+        if (threads.empty()) {
+            fn(0);
+            return;
+        }
+        using Task = std::remove_reference_t<Fn>;
+        {
+            std::lock_guard lock{mutex};
+            task = [](void* data, int worker) { (*static_cast<Task*>(data))(worker); };
+            task_data = const_cast<void*>(static_cast<const void*>(&fn));
+            running = threads.size();
+            generation++;
+        }
+        start_condition.notify_all();
+        fn(0);
+        std::unique_lock lock{mutex};
+        done_condition.wait(lock, [this] { return running == 0; });
+    }
+
+    // Calls fn(task) or fn(task, worker) for every task in [0, count), tasks are handed out to whichever worker is free
+    template <typename Fn>
+    void parallelTasks(int count, Fn&& fn) {
+        std::atomic<int> next_task{0};
+        run([&](int worker) {
+            for (int i = next_task.fetch_add(1, std::memory_order_relaxed); i < count; i = next_task.fetch_add(1, std::memory_order_relaxed)) {
+                if constexpr (std::is_invocable_v<Fn, int, int>) {
+                    fn(i, worker);
+                } else {
+                    fn(i);
+                }
+            }
+        });
+    }
+
+    // Splits [0, count) into one contiguous range per worker and calls fn(begin, end) or fn(begin, end, worker) for each of them.
+    // Ranges start on multiples of 16 so workers don't share cache lines of float arrays, and always follow the worker order.
+    template <typename Fn>
+    void parallelFor(int count, Fn&& fn) {
+        const int workers = size();
+        const int chunk = ((count + workers - 1) / workers + 15) & ~15;
+        run([&](int worker) {
+            const int begin = std::min(count, worker * chunk);
+            const int end = std::min(count, begin + chunk);
+            if constexpr (std::is_invocable_v<Fn, int, int, int>) {
+                fn(begin, end, worker);
+            } else if (begin < end) {
+                fn(begin, end);
+            }
+        });
+    }
+
+  private:
+    void workerLoop(int worker) {
+        uint64_t seen_generation = 0;
+        std::unique_lock lock{mutex};
+        while (true) {
+            start_condition.wait(lock, [&] { return stopping || generation != seen_generation; });
+            if (stopping) {
+                return;
+            }
+            seen_generation = generation;
+            const auto current_task = task;
+            void* const current_data = task_data;
+            lock.unlock();
+            current_task(current_data, worker);
+            lock.lock();
+            if (--running == 0) {
+                done_condition.notify_one();
+            }
+        }
+    }
+};
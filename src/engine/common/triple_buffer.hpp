@@ -0,0 +1,39 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+// Hands the latest value from one writer thread to one reader thread without locks. The writer fills its back slot
+// and publishes it, the reader takes the latest published slot, neither ever waits for the other.
+// A value the reader holds is never written until the reader takes a newer one.
+template <typename T>
+struct TripleBuffer {
+    static constexpr uint8_t index_mask = 3;
+    static constexpr uint8_t fresh_bit = 4;  // set while the middle slot holds a value the reader didn't take yet
+
+    T slots[3];
+    std::atomic<uint8_t> middle{1};  // slot exchanged between the writer and the reader
+    uint8_t back = 0;                // only used by the writer
+    uint8_t front = 2;               // only used by the reader
+
+    T& getWriteBuffer() {
+        return slots[back];
+    }
+
+    // Makes the back slot the latest value and gets the previous middle slot as the new back slot
+    void publish() {
+        back = middle.exchange(back | fresh_bit, std::memory_order_acq_rel) & index_mask;
+    }
+
+    // Takes the latest published value if there is one the reader didn't take yet, returns false otherwise
+    bool update() {
+        if (!(middle.load(std::memory_order_acquire) & fresh_bit)) {
+            return false;
+        }
+        front = middle.exchange(front, std::memory_order_acq_rel) & index_mask;
+        return true;
+    }
+
+    const T& getReadBuffer() const {
+        return slots[front];
+    }
+};
@@ -0,0 +1,126 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "particles.hpp"
+
+// Keeps two particles at a set distance, like a rod or a spring between their centers
+struct DistanceLink {
+    ObjectHandle a;
+    ObjectHandle b;
+    float rest_length;
+    float stiffness;     // fraction of the length error corrected per pass, 1 for a rigid rod
+    float break_strain;  // the link breaks once stretched by more than this fraction of its rest length, 0 never breaks
+};
+
+// Moves both particles along their axis back toward the rest length, each by the share of the error given by the mass
+// of the other one, like contacts. Returns false when the link broke or one of its particles was removed.
+inline bool solveDistanceLink(Particles& particles, const DistanceLink& link, int sleep_steps, float sleep_threshold) {
+    if (!particles.isAlive(link.a) || !particles.isAlive(link.b)) {
+        return false;
+    }
+    const int a = particles.indices[link.a.id];
+    const int b = particles.indices[link.b.id];
+    if (sleep_steps > 0 && particles.rest[a] >= sleep_steps && particles.rest[b] >= sleep_steps) {
+        return true;
+    }
+    const float diff_x = particles.x[a] - particles.x[b];
+    const float diff_y = particles.y[a] - particles.y[b];
+    const float dist = std::sqrt(diff_x * diff_x + diff_y * diff_y);
+    if (dist == 0.0f) {
+        return true;
+    }
+    const float stretch = dist - link.rest_length;
+    if (link.break_strain > 0.0f && stretch > link.break_strain * link.rest_length) {
+        return false;
+    }
+    const float mass_a = particles.radius[a] * particles.radius[a];
+    const float mass_b = particles.radius[b] * particles.radius[b];
+    const float delta = link.stiffness * stretch / (dist * (mass_a + mass_b));
+    const float col_a_x = diff_x * (delta * mass_b);
+    const float col_a_y = diff_y * (delta * mass_b);
+    const float col_b_x = diff_x * (delta * mass_a);
+    const float col_b_y = diff_y * (delta * mass_a);
+    const float threshold_sq = sleep_threshold * sleep_threshold;
+    if (sleep_steps > 0 && (col_a_x * col_a_x + col_a_y * col_a_y > threshold_sq || col_b_x * col_b_x + col_b_y * col_b_y > threshold_sq)) {
+        particles.rest[a] = 0;
+        particles.rest[b] = 0;
+    }
+    particles.x[a] -= col_a_x;
+    particles.y[a] -= col_a_y;
+    particles.x[b] += col_b_x;
+    particles.y[b] += col_b_y;
+    return true;
+}
+
+// Distance links grouped by color, links of a color never share a particle so each color is solved in parallel.
+// A link gets the lowest color neither of its particles uses yet when it is added, and removing a link keeps the
+// coloring valid, so it only changes incrementally and is never computed again from scratch.
+struct DistanceConstraints {
+    std::vector<std::vector<DistanceLink>> color_links;  // links of each color
+    std::vector<std::vector<uint8_t>> color_broken;      // links of each color found broken by the last pass
+    std::vector<uint64_t> particle_colors;               // colors used by the links of each particle id, 64 at most
+    size_t link_count = 0;
+    size_t broken_count = 0;  // links removed since the counter was last reset
+
+    // Returns false when the particles already use every color between them
+    bool add(const DistanceLink& link) {
+        const uint64_t used = getColors(link.a.id) | getColors(link.b.id);
+        if (used == ~uint64_t{0}) {
+            return false;
+        }
+        insert(link, std::countr_one(used));
+        return true;
+    }
+
+    // Puts the link in a color below 64 that neither of its particles uses yet, like a link restored from a snapshot
+    void insert(const DistanceLink& link, int color) {
+        const size_t ids = std::max(link.a.id, link.b.id) + 1;
+        if (particle_colors.size() < ids) {
+            particle_colors.resize(ids, 0);
+        }
+        if (color >= static_cast<int>(color_links.size())) {
+            color_links.resize(color + 1);
+            color_broken.resize(color + 1);
+        }
+        color_links[color].push_back(link);
+        particle_colors[link.a.id] |= uint64_t{1} << color;
+        particle_colors[link.b.id] |= uint64_t{1} << color;
+        link_count++;
+    }
+
+    uint64_t getColors(int id) const {
+        return id < static_cast<int>(particle_colors.size()) ? particle_colors[id] : 0;
+    }
+
+    // Removes the links flagged in color_broken by moving the last link of their color into their slot.
+    // The ids of removed particles keep their colors until their links are found and removed here.
+    void removeBroken() {
+        for (size_t color = 0; color < color_links.size(); color++) {
+            std::vector<DistanceLink>& links = color_links[color];
+            std::vector<uint8_t>& broken = color_broken[color];
+            for (size_t i = links.size(); i--;) {
+                if (!broken[i]) {
+                    continue;
+                }
+                const uint64_t bit = uint64_t{1} << color;
+                particle_colors[links[i].a.id] &= ~bit;
+                particle_colors[links[i].b.id] &= ~bit;
+                links[i] = links.back();
+                links.pop_back();
+                link_count--;
+                broken_count++;
+            }
+        }
+    }
+
+    void clear() {
+        color_links.clear();
+        color_broken.clear();
+        particle_colors.clear();
+        link_count = 0;
+    }
+};
@@ -0,0 +1,484 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <new>
+#include <optional>
+#include <span>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "physics.hpp"
+
+// Domain decomposition: the world is cut into vertical strips, each owned by a solver running in its own process.
+// Before every substep neighbours exchange, through memory shared by all the processes:
+// - migrants, the particles that left the strip of their owner, which become owned by the neighbour
+// - ghosts, the particles owned within reach of the border, which the neighbour holds as copies refreshed every substep
+// Contacts across a border are solved on both sides, each owner only keeping the correction of its own particle,
+// so together they apply the whole correction like a single solver would.
+
+// A particle crossing a border, as a ghost or as a migrant
+struct DomainParticle {
+    int32_t id;  // global id, the index of the particle in the objects given to runDomains
+    float x;
+    float y;
+    float last_x;
+    float last_y;
+    float radius;
+};
+
+// Barrier of the processes sharing the memory it lives in. Once aborted every wait returns false instead of waiting
+// for a process that may never come.
+struct SharedBarrier {
+    std::atomic<uint32_t> waiting{0};
+    std::atomic<uint32_t> phase{0};
+    std::atomic<uint32_t> aborted{0};
+
+    bool wait(uint32_t count) {
+        const uint32_t current = phase.load(std::memory_order_acquire);
+        if (waiting.fetch_add(1, std::memory_order_acq_rel) + 1 == count) {
+            waiting.store(0, std::memory_order_relaxed);
+            phase.fetch_add(1, std::memory_order_release);
+            return !isAborted();
+        }
+        while (phase.load(std::memory_order_acquire) == current) {
+            if (isAborted()) {
+                return false;
+            }
+            std::this_thread::yield();
+        }
+        return true;
+    }
+
+    void abort() {
+        aborted.store(1, std::memory_order_release);
+    }
+
+    bool isAborted() const {
+        return aborted.load(std::memory_order_acquire) != 0;
+    }
+};
+
+// Atomics shared by processes must not rely on a lock of one process
+static_assert(std::atomic<uint32_t>::is_always_lock_free);
+
+struct DomainWorkerStats {
+    int owned = 0;          // particles owned at the end
+    int ghosts = 0;         // ghosts held at the end
+    int64_t migrations = 0;  // particles sent to a neighbour
+    int64_t exchange_ns = 0;  // time spent exchanging with the neighbours, waits included
+    int64_t step_ns = 0;      // time spent in PhysicsSolver::update
+};
+
+struct DomainHeader {
+    SharedBarrier barrier;
+    std::atomic<int> ready{0};  // workers done with their setup
+    std::atomic<int> go{0};     // set by the coordinator once every worker is ready
+};
+
+// Offsets of the shared memory of workers processes exchanging at most capacity particles in one message
+struct DomainLayout {
+    size_t counts;     // int32 particle count of each message
+    size_t messages;   // DomainParticle arrays of each message
+    size_t result_x;   // final positions in global id order
+    size_t result_y;
+    size_t owners;     // int32 worker owning each particle at the end
+    size_t stats;      // DomainWorkerStats of each worker
+    size_t end;
+
+    DomainLayout(int workers, uint32_t capacity) {
+        const auto next = [](size_t offset, size_t bytes) { return (offset + bytes + 63) & ~size_t{63}; };
+        counts = next(0, sizeof(DomainHeader));
+        messages = next(counts, getMessageCount(workers) * sizeof(int32_t));
+        result_x = next(messages, getMessageCount(workers) * capacity * sizeof(DomainParticle));
+        result_y = next(result_x, capacity * sizeof(float));
+        owners = next(result_y, capacity * sizeof(float));
+        stats = next(owners, capacity * sizeof(int32_t));
+        end = next(stats, workers * sizeof(DomainWorkerStats));
+    }
+
+    // Every worker sends halo and migrants messages to its left and right neighbours
+    static size_t getMessageCount(int workers) {
+        return workers * 4;
+    }
+};
+
+enum class DomainMessage {
+    Halo,
+    Migrants,
+};
+
+struct DomainOptions {
+    int workers = 2;
+    int frames = 100;
+    int sub_steps = 8;
+    float dt = 1.0f / 60.0f;
+    Vec2 gravity = {0.0f, 20.0f};
+    Broadphase broadphase = Broadphase::Grid;
+    int threads = 1;  // solver threads of each worker
+};
+
+struct DomainResult {
+    std::vector<float> x;  // final positions in global id order
+    std::vector<float> y;
+    int64_t physics_ns = 0;  // from the start of the first substep to the end of the slowest worker
+    std::vector<DomainWorkerStats> workers;
+    bool consistent = false;  // every particle ended up owned by exactly one worker
+};
+
+// Shared memory seen from one process, mapped before forking so every process sees it at the same address
+struct DomainShared {
+    char* memory;
+    DomainLayout layout;
+    int workers;
+    uint32_t capacity;
+
+    DomainHeader& getHeader() const {
+        return *reinterpret_cast<DomainHeader*>(memory);
+    }
+
+    // Message sent by a worker to its left (side 0) or right (side 1) neighbour
+    size_t getMessage(int worker, int side, DomainMessage type) const {
+        return (worker * 2 + side) * 2 + static_cast<int>(type);
+    }
+
+    int32_t& getCount(size_t message) const {
+        return reinterpret_cast<int32_t*>(memory + layout.counts)[message];
+    }
+
+    DomainParticle* getParticles(size_t message) const {
+        return reinterpret_cast<DomainParticle*>(memory + layout.messages) + message * capacity;
+    }
+
+    template <typename T>
+    T* getArray(size_t offset) const {
+        return reinterpret_cast<T*>(memory + offset);
+    }
+};
+
+// Solver of one strip, with the mapping between its local ids and the global ones
+struct DomainWorker {
+    const DomainShared& shared;
+    int index;
+    PhysicsSolver solver;
+    float halo;                     // width of the band along a border whose particles are sent as ghosts
+    std::vector<int> global_ids;    // global id of each local id
+    std::vector<int> local_ids;     // local id of each global id, -1 when the particle isn't in this strip
+    std::vector<uint8_t> ghosts;    // 1 for the local ids of ghosts
+    std::vector<int> seen;          // exchange round when each ghost was last refreshed
+    std::vector<PhysicsObject> arrivals;  // particles new to this strip during an exchange
+    std::vector<int> arrival_ids;
+    std::vector<uint8_t> arrival_ghosts;
+    std::vector<ObjectHandle> departures;
+    DomainWorkerStats stats;
+    int round = 0;
+
+    DomainWorker(const DomainShared& _shared, int _index, const Vec2& world_size, const DomainOptions& options, float max_radius)
+        : shared{_shared}, index{_index}, solver{world_size, options.broadphase, options.threads}, local_ids(_shared.capacity, -1) {
+        solver.gravity = options.gravity;
+        solver.sub_steps = 1;  // substeps are run one by one, with an exchange before each
+        halo = 2.0f * max_radius + solver.pair_skin + 0.5f;
+    }
+
+    int getOwner(float x) const {
+        return std::clamp(static_cast<int>(x / solver.world_size.x * shared.workers), 0, shared.workers - 1);
+    }
+
+    float getStripBegin(int worker) const {
+        return solver.world_size.x * worker / shared.workers;
+    }
+
+    void addArrivals() {
+        if (arrivals.empty()) {
+            return;
+        }
+        const int first = solver.addObjects(arrivals);
+        for (size_t k = 0; k < arrivals.size(); k++) {
+            const int id = solver.getHandle(first + k).id;
+            if (id >= static_cast<int>(global_ids.size())) {
+                global_ids.resize(id + 1, -1);
+                ghosts.resize(id + 1, 0);
+                seen.resize(id + 1, 0);
+            }
+            global_ids[id] = arrival_ids[k];
+            local_ids[arrival_ids[k]] = id;
+            ghosts[id] = arrival_ghosts[k];
+            seen[id] = round;
+        }
+        arrivals.clear();
+        arrival_ids.clear();
+        arrival_ghosts.clear();
+    }
+
+    void add(const DomainParticle& particle, bool ghost) {
+        PhysicsObject& object = arrivals.emplace_back(Vec2{particle.x, particle.y});
+        object.last_position = {particle.last_x, particle.last_y};
+        object.radius = particle.radius;
+        arrival_ids.push_back(particle.id);
+        arrival_ghosts.push_back(ghost);
+    }
+
+    void send(int side, DomainMessage type, int i) {
+        const size_t message = shared.getMessage(index, side, type);
+        const Particles& particles = solver.particles;
+        shared.getParticles(message)[shared.getCount(message)++] = {global_ids[particles.ids[i]], particles.x[i], particles.y[i], particles.last_x[i], particles.last_y[i], particles.radius[i]};
+    }
+
+    // Sends migrants and ghosts to both neighbours, then takes theirs. Owned particles that left the strip stay here as
+    // ghosts until the new owner sends them back, ghosts it didn't send again are removed.
+    // Returns false when the barrier was aborted.
+    bool exchange(SharedBarrier& barrier) {
+        round++;
+        Particles& particles = solver.particles;
+        for (int side = 0; side < 2; side++) {
+            shared.getCount(shared.getMessage(index, side, DomainMessage::Halo)) = 0;
+            shared.getCount(shared.getMessage(index, side, DomainMessage::Migrants)) = 0;
+        }
+        const float begin = getStripBegin(index);
+        const float end = getStripBegin(index + 1);
+        for (int i = 0; i < static_cast<int>(particles.size()); i++) {
+            const int id = particles.ids[i];
+            if (ghosts[id]) {
+                continue;
+            }
+            const int owner = getOwner(particles.x[i]);
+            if (owner != index) {
+                send(owner < index ? 0 : 1, DomainMessage::Migrants, i);
+                ghosts[id] = 1;
+                seen[id] = round;
+                stats.migrations++;
+                continue;
+            }
+            if (index > 0 && particles.x[i] < begin + halo) {
+                send(0, DomainMessage::Halo, i);
+            }
+            if (index < shared.workers - 1 && particles.x[i] >= end - halo) {
+                send(1, DomainMessage::Halo, i);
+            }
+        }
+        if (!barrier.wait(shared.workers)) {
+            return false;
+        }
+
+        // The left neighbour sends to its right side, the right neighbour to its left side
+        for (const int neighbour : {index - 1, index + 1}) {
+            if (neighbour < 0 || neighbour >= shared.workers) {
+                continue;
+            }
+            const int side = neighbour < index ? 1 : 0;
+            for (const DomainMessage type : {DomainMessage::Migrants, DomainMessage::Halo}) {
+                const size_t message = shared.getMessage(neighbour, side, type);
+                const DomainParticle* received = shared.getParticles(message);
+                const bool ghost = type == DomainMessage::Halo;
+                for (int k = 0; k < shared.getCount(message); k++) {
+                    const DomainParticle& particle = received[k];
+                    const int id = local_ids[particle.id];
+                    if (id == -1) {
+                        add(particle, ghost);
+                        continue;
+                    }
+                    const int i = particles.indices[id];
+                    particles.x[i] = particle.x;
+                    particles.y[i] = particle.y;
+                    particles.last_x[i] = particle.last_x;
+                    particles.last_y[i] = particle.last_y;
+                    particles.rest[i] = 0;
+                    ghosts[id] = ghost;
+                    seen[id] = round;
+                }
+            }
+        }
+        addArrivals();
+
+        for (int i = 0; i < static_cast<int>(particles.size()); i++) {
+            const int id = particles.ids[i];
+            if (ghosts[id] && seen[id] != round) {
+                departures.push_back(solver.getHandle(i));
+            }
+        }
+        for (const ObjectHandle& handle : departures) {
+            local_ids[global_ids[handle.id]] = -1;
+            ghosts[handle.id] = 0;
+            solver.removeObject(handle);
+        }
+        departures.clear();
+        // Messages are overwritten by the next exchange once every neighbour read them
+        return barrier.wait(shared.workers);
+    }
+
+    // Returns false when another process failed first
+    bool run(std::span<const PhysicsObject> objects, const DomainOptions& options) {
+        for (size_t k = 0; k < objects.size(); k++) {
+            if (getOwner(objects[k].position.x) == index) {
+                arrivals.push_back(objects[k]);
+                arrival_ids.push_back(k);
+                arrival_ghosts.push_back(0);
+            }
+        }
+        addArrivals();
+
+        DomainHeader& header = shared.getHeader();
+        header.ready.fetch_add(1, std::memory_order_acq_rel);
+        while (!header.go.load(std::memory_order_acquire)) {
+            if (header.barrier.isAborted()) {
+                return false;
+            }
+            std::this_thread::yield();
+        }
+
+        using clock = std::chrono::steady_clock;
+        const float sub_dt = options.dt / static_cast<float>(options.sub_steps);
+        for (int step = options.frames * options.sub_steps; step--;) {
+            const auto exchange_start = clock::now();
+            if (!exchange(header.barrier)) {
+                return false;
+            }
+            const auto step_start = clock::now();
+            solver.update(sub_dt);
+            stats.exchange_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(step_start - exchange_start).count();
+            stats.step_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - step_start).count();
+        }
+
+        // Strips never share an owned particle, so results are written without synchronization
+        const Particles& particles = solver.particles;
+        float* x = shared.getArray<float>(shared.layout.result_x);
+        float* y = shared.getArray<float>(shared.layout.result_y);
+        int32_t* owners = shared.getArray<int32_t>(shared.layout.owners);
+        for (int i = 0; i < static_cast<int>(particles.size()); i++) {
+            const int id = particles.ids[i];
+            if (ghosts[id]) {
+                stats.ghosts++;
+                continue;
+            }
+            const int global_id = global_ids[id];
+            x[global_id] = particles.x[i];
+            y[global_id] = particles.y[i];
+            owners[global_id] = index;
+            stats.owned++;
+        }
+        shared.getArray<DomainWorkerStats>(shared.layout.stats)[index] = stats;
+        return true;
+    }
+};
+
+// Simulates objects for options.frames frames split over options.workers processes forked from this one, the global id of
+// an object being its index. Only this thread may be running when it is called, as forking copies no other thread.
+// Returns nothing when the processes can't be started or one of them fails, and on platforms without fork. The first
+// worker to fail aborts the barrier, and once a worker is seen exiting abnormally the others are killed.
+inline std::optional<DomainResult> runDomains(const Vec2& world_size, std::span<const PhysicsObject> objects, const DomainOptions& options) {
+#if defined(__unix__) || defined(__APPLE__)
+    const uint32_t capacity = objects.size();
+    const DomainLayout layout{options.workers, capacity};
+    // Pages are only backed once touched, so sizing every message for all the particles costs little
+    void* mapping = ::mmap(nullptr, layout.end, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        return std::nullopt;
+    }
+    const DomainShared view{static_cast<char*>(mapping), layout, options.workers, capacity};
+    DomainHeader& header = *new (mapping) DomainHeader{};
+    std::fill_n(view.getArray<int32_t>(view.layout.owners), capacity, -1);
+
+    float max_radius = 0.5f;
+    for (const PhysicsObject& object : objects) {
+        max_radius = std::max(max_radius, object.radius);
+    }
+
+    std::vector<pid_t> pids;
+    bool started = true;
+    for (int worker = 0; worker < options.workers; worker++) {
+        const pid_t pid = ::fork();
+        if (pid == 0) {
+            bool completed = false;
+            try {
+                completed = DomainWorker{view, worker, world_size, options, max_radius}.run(objects, options);
+            } catch (...) {
+            }
+            if (!completed) {
+                header.barrier.abort();
+            }
+            ::_exit(completed ? 0 : 1);
+        }
+        if (pid < 0) {
+            started = false;
+            break;
+        }
+        pids.push_back(pid);
+    }
+    if (!started) {
+        for (const pid_t pid : pids) {
+            ::kill(pid, SIGKILL);
+            ::waitpid(pid, nullptr, 0);
+        }
+        ::munmap(mapping, view.layout.end);
+        return std::nullopt;
+    }
+
+    // Reaps the workers that exited without blocking, a worker killed by a signal can't abort the barrier itself
+    size_t running = pids.size();
+    bool succeeded = true;
+    const auto pollWorkers = [&] {
+        for (pid_t& pid : pids) {
+            int status = 0;
+            if (pid == 0 || ::waitpid(pid, &status, WNOHANG) != pid) {
+                continue;
+            }
+            pid = 0;
+            running--;
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                succeeded = false;
+            }
+        }
+        return succeeded;
+    };
+
+    while (header.ready.load(std::memory_order_acquire) < options.workers && pollWorkers()) {
+        std::this_thread::yield();
+    }
+    const auto start = std::chrono::steady_clock::now();
+    header.go.store(1, std::memory_order_release);
+    while (running > 0 && pollWorkers()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds{1});
+    }
+    if (!succeeded) {
+        header.barrier.abort();
+        for (const pid_t pid : pids) {
+            if (pid != 0) {
+                ::kill(pid, SIGKILL);
+                ::waitpid(pid, nullptr, 0);
+            }
+        }
+    }
+
+    DomainResult result;
+    result.physics_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    if (succeeded) {
+        const float* x = view.getArray<float>(view.layout.result_x);
+        const float* y = view.getArray<float>(view.layout.result_y);
+        const int32_t* owners = view.getArray<int32_t>(view.layout.owners);
+        result.x.assign(x, x + capacity);
+        result.y.assign(y, y + capacity);
+        const DomainWorkerStats* stats = view.getArray<DomainWorkerStats>(view.layout.stats);
+        result.workers.assign(stats, stats + options.workers);
+        size_t owned = 0;
+        for (const DomainWorkerStats& worker : result.workers) {
+            owned += worker.owned;
+        }
+        result.consistent = owned == capacity && std::none_of(owners, owners + capacity, [](int32_t owner) { return owner == -1; });
+    }
+    ::munmap(mapping, view.layout.end);
+    if (!succeeded) {
+        return std::nullopt;
+    }
+    return result;
+#else
+    return std::nullopt;
+#endif
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Verlet integration of one axis between two walls:
+// position = clamp(2 * p - last_position + acceleration * dt^2, low + radius, high - radius), last_position = p
+// with p = clamp(position, low + radius, high - radius). Contacts can push a particle into a wall after the last
+// integration, clamping it before taking the velocity keeps the wall from throwing it back.
+// Both axes are independent, so the kernel runs once on the x arrays and once on the y arrays.
+inline void integrateAxis(float* position, float* last_position, const float* radius, size_t begin, size_t end, float acceleration, float dt, float low, float high) {
+    const float acc_dt2 = acceleration * (dt * dt);
+    size_t i = begin;
+
+#if defined(__AVX2__)
+    const __m256 two_8 = _mm256_set1_ps(2.0f);
+    const __m256 acc_8 = _mm256_set1_ps(acc_dt2);
+    const __m256 low_8 = _mm256_set1_ps(low);
+    const __m256 high_8 = _mm256_set1_ps(high);
+    for (; i + 8 <= end; i += 8) {
+        const __m256 r = _mm256_loadu_ps(radius + i);
+        const __m256 min_pos = _mm256_add_ps(low_8, r);
+        const __m256 max_pos = _mm256_sub_ps(high_8, r);
+        const __m256 pos = _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(position + i), min_pos), max_pos);
+        const __m256 last = _mm256_loadu_ps(last_position + i);
+        const __m256 v = _mm256_sub_ps(_mm256_mul_ps(two_8, pos), last);
+        const __m256 new_pos = _mm256_add_ps(v, acc_8);
+        _mm256_storeu_ps(last_position + i, pos);
+        _mm256_storeu_ps(position + i, _mm256_min_ps(_mm256_max_ps(new_pos, min_pos), max_pos));
+    }
+#endif
+
+#if defined(__SSE2__)
+    const __m128 two_4 = _mm_set1_ps(2.0f);
+    const __m128 acc_4 = _mm_set1_ps(acc_dt2);
+    const __m128 low_4 = _mm_set1_ps(low);
+    const __m128 high_4 = _mm_set1_ps(high);
+    for (; i + 4 <= end; i += 4) {
+        const __m128 r = _mm_loadu_ps(radius + i);
+        const __m128 min_pos = _mm_add_ps(low_4, r);
+        const __m128 max_pos = _mm_sub_ps(high_4, r);
+        const __m128 pos = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(position + i), min_pos), max_pos);
+        const __m128 last = _mm_loadu_ps(last_position + i);
+        const __m128 v = _mm_sub_ps(_mm_mul_ps(two_4, pos), last);
+        const __m128 new_pos = _mm_add_ps(v, acc_4);
+        _mm_storeu_ps(last_position + i, pos);
+        _mm_storeu_ps(position + i, _mm_min_ps(_mm_max_ps(new_pos, min_pos), max_pos));
+    }
+#endif
+
+    // Scalar fallback and remainder
+    for (; i < end; i++) {
+        const float min_pos = low + radius[i];
+        const float max_pos = high - radius[i];
+        const float pos = std::min(std::max(position[i], min_pos), max_pos);
+        const float v = 2.0f * pos - last_position[i];
+        const float new_pos = v + acc_dt2;
+        last_position[i] = pos;
+        position[i] = std::min(std::max(new_pos, min_pos), max_pos);
+    }
+}
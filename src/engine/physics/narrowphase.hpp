@@ -0,0 +1,324 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Two particles close enough to touch, a is always lower than b
+struct ContactPair {
+    int a;
+    int b;
+};
+
+// Particle arrays written by the narrowphase
+struct ContactState {
+    float* x;
+    float* y;
+    const float* radius;
+    uint8_t* rest;
+    uint8_t* support;       // set for the particles of overlapping pairs, which rest on something, only written while sleeping is enabled
+    int sleep_steps;        // 0 when sleeping is disabled
+    float sleep_threshold;  // contact corrections larger than this wake both particles up
+};
+
+struct ContactStats {
+    size_t contacts = 0;  // pairs that overlapped
+    float deepest = 0.0f;  // deepest overlap before its correction
+};
+
+constexpr size_t contact_batch_size = 8;
+
+// Moves both particles apart along their axis until they touch, each by the share of the overlap given by the mass of
+// the other one, masses growing with the area. Returns the overlap before the correction, 0 when they don't overlap or
+// both sleep, as they already rest against each other.
+inline float solveContactPair(const ContactState& state, int a, int b) {
+    if (state.sleep_steps > 0 && state.rest[a] >= state.sleep_steps && state.rest[b] >= state.sleep_steps) {
+        return 0.0f;
+    }
+    const float diff_x = state.x[a] - state.x[b];
+    const float diff_y = state.y[a] - state.y[b];
+    const float dist_sq = diff_x * diff_x + diff_y * diff_y;
+    const float contact = state.radius[a] + state.radius[b];
+    if (dist_sq >= contact * contact || dist_sq == 0.0f) {
+        return 0.0f;
+    }
+    const float dist = std::sqrt(dist_sq);
+    const float mass_a = state.radius[a] * state.radius[a];
+    const float mass_b = state.radius[b] * state.radius[b];
+    const float overlap = contact - dist;
+    const float delta_a = overlap * (mass_b / (mass_a + mass_b));
+    const float delta_b = overlap * (mass_a / (mass_a + mass_b));
+    const float col_a_x = (diff_x / dist) * delta_a;
+    const float col_a_y = (diff_y / dist) * delta_a;
+    const float col_b_x = (diff_x / dist) * delta_b;
+    const float col_b_y = (diff_y / dist) * delta_b;
+    const float threshold_sq = state.sleep_threshold * state.sleep_threshold;
+    if (state.sleep_steps > 0) {
+        state.support[a] = 1;
+        state.support[b] = 1;
+        if (col_a_x * col_a_x + col_a_y * col_a_y > threshold_sq || col_b_x * col_b_x + col_b_y * col_b_y > threshold_sq) {
+            state.rest[a] = 0;
+            state.rest[b] = 0;
+        }
+    }
+    state.x[a] += col_a_x;
+    state.y[a] += col_a_y;
+    state.x[b] -= col_b_x;
+    state.y[b] -= col_b_y;
+    return overlap;
+}
+
+// Reorders pairs so the first returned count of them form groups of contact_batch_size pairs sharing no particle,
+// which lets a group be solved at once without two lanes writing the same particle. Each pair goes to the oldest open
+// group it doesn't conflict with, pairs left in groups that never filled up come last and are solved one by one.
+// The order only depends on the input order. scratch is reused between calls, busy holds a zero byte per particle and
+// is left that way, it marks the open groups holding each particle so a pair is placed without scanning them.
+inline size_t batchContactPairs(std::vector<ContactPair>& pairs, std::vector<ContactPair>& scratch, std::vector<uint8_t>& busy) {
+    struct Batch {
+        std::array<ContactPair, contact_batch_size> pairs;
+        size_t size = 0;
+    };
+
+    // A pair conflicting with every open group opens a new one, evicting the oldest once there are too many. Groups
+    // keep their slot while open, age orders the slots from the oldest.
+    constexpr size_t max_open = 8;
+    std::array<Batch, max_open> open;
+    std::array<int, max_open> age;
+    size_t open_count = 0;
+    unsigned free_slots = (1u << max_open) - 1;
+    const auto close = [&](size_t position) {
+        const int slot = age[position];
+        const Batch& batch = open[slot];
+        for (size_t k = 0; k < batch.size; k++) {
+            busy[batch.pairs[k].a] &= ~(1u << slot);
+            busy[batch.pairs[k].b] &= ~(1u << slot);
+        }
+        std::move(age.begin() + position + 1, age.begin() + open_count, age.begin() + position);
+        open_count--;
+        free_slots |= 1u << slot;
+    };
+    // Full groups go to scratch, evicted pairs back to the front of pairs, which was already read past them
+    size_t evicted = 0;
+    scratch.clear();
+    for (size_t r = 0; r < pairs.size(); r++) {
+        const ContactPair pair = pairs[r];
+        const unsigned conflicts = busy[pair.a] | busy[pair.b];
+        size_t position = 0;
+        while (position < open_count && (conflicts >> age[position] & 1)) {
+            position++;
+        }
+        if (position == open_count) {
+            if (open_count == max_open) {
+                const Batch& oldest = open[age[0]];
+                std::copy(oldest.pairs.begin(), oldest.pairs.begin() + oldest.size, pairs.begin() + evicted);
+                evicted += oldest.size;
+                close(0);
+                position = open_count;
+            }
+            const int slot = std::countr_zero(free_slots);
+            free_slots &= ~(1u << slot);
+            open[slot].size = 0;
+            age[open_count++] = slot;
+        }
+        const int slot = age[position];
+        Batch& batch = open[slot];
+        batch.pairs[batch.size++] = pair;
+        busy[pair.a] |= 1u << slot;
+        busy[pair.b] |= 1u << slot;
+        if (batch.size == contact_batch_size) {
+            scratch.insert(scratch.end(), batch.pairs.begin(), batch.pairs.end());
+            close(position);
+        }
+    }
+    const size_t batched = scratch.size();
+    scratch.insert(scratch.end(), pairs.begin(), pairs.begin() + evicted);
+    while (open_count > 0) {
+        const Batch& batch = open[age[0]];
+        scratch.insert(scratch.end(), batch.pairs.begin(), batch.pairs.begin() + batch.size);
+        close(0);
+    }
+    pairs.swap(scratch);
+    return batched;
+}
+
+// Solves pairs in order, or in reverse order when reverse is set, the first batched of them (a multiple of
+// contact_batch_size from batchContactPairs) a group at a time with AVX2 or SSE when the compiler targets them.
+// Groups apply the same correction as solveContactPair, with the distance from a refined reciprocal square root.
+inline void solveContactPairs(const ContactState& state, const ContactPair* pairs, size_t batched, size_t count, bool reverse, ContactStats& stats) {
+    size_t solved = 0;  // leading pairs solved in groups, the others are solved one by one
+#if defined(__AVX2__) || defined(__SSE2__)
+    solved = batched;
+#endif
+    const float threshold_sq = state.sleep_threshold * state.sleep_threshold;
+
+    // Lanes holding two sleeping particles are left out
+    const auto getAwakeMask = [&](size_t first, size_t lanes) {
+        int mask = (1 << lanes) - 1;
+        if (state.sleep_steps > 0) {
+            for (size_t k = 0; k < lanes; k++) {
+                if (state.rest[pairs[first + k].a] >= state.sleep_steps && state.rest[pairs[first + k].b] >= state.sleep_steps) {
+                    mask &= ~(1 << k);
+                }
+            }
+        }
+        return mask;
+    };
+    // Lanes never share a particle, so they are written back in any order
+    const auto scatter = [&](size_t first, int mask, int wake, const float* col) {
+        for (; mask; mask &= mask - 1) {
+            const int k = std::countr_zero(static_cast<unsigned>(mask));
+            const ContactPair& pair = pairs[first + k];
+            state.x[pair.a] += col[k];
+            state.y[pair.a] += col[8 + k];
+            state.x[pair.b] -= col[16 + k];
+            state.y[pair.b] -= col[24 + k];
+            if (state.sleep_steps > 0) {
+                state.support[pair.a] = 1;
+                state.support[pair.b] = 1;
+            }
+            if (wake & (1 << k)) {
+                state.rest[pair.a] = 0;
+                state.rest[pair.b] = 0;
+            }
+        }
+    };
+
+    const auto solveRemaining = [&]() {
+        for (size_t k = solved; k < count; k++) {
+            const size_t i = reverse ? count - 1 - (k - solved) : k;
+            const float overlap = solveContactPair(state, pairs[i].a, pairs[i].b);
+            if (overlap > 0.0f) {
+                stats.contacts++;
+                stats.deepest = std::max(stats.deepest, overlap);
+            }
+        }
+    };
+    if (reverse) {
+        solveRemaining();
+    }
+
+#if defined(__AVX2__)
+    {
+        const __m256 zero_8 = _mm256_setzero_ps();
+        const __m256 half_8 = _mm256_set1_ps(0.5f);
+        const __m256 three_halves_8 = _mm256_set1_ps(1.5f);
+        const __m256 threshold_8 = _mm256_set1_ps(threshold_sq);
+        const __m256i deinterleave = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+        __m256 deepest_8 = zero_8;
+        alignas(32) float col[32];  // x then y of the correction of a, then of b
+        for (size_t group = 0; group < batched / 8; group++) {
+            const size_t i = reverse ? batched - 8 * (group + 1) : 8 * group;
+            // Splits 8 (a, b) pairs into one register of a and one of b
+            const __m256i lo = _mm256_permutevar8x32_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(pairs + i)), deinterleave);
+            const __m256i hi = _mm256_permutevar8x32_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(pairs + i + 4)), deinterleave);
+            const __m256i a = _mm256_permute2x128_si256(lo, hi, 0x20);
+            const __m256i b = _mm256_permute2x128_si256(lo, hi, 0x31);
+            const __m256 diff_x = _mm256_sub_ps(_mm256_i32gather_ps(state.x, a, 4), _mm256_i32gather_ps(state.x, b, 4));
+            const __m256 diff_y = _mm256_sub_ps(_mm256_i32gather_ps(state.y, a, 4), _mm256_i32gather_ps(state.y, b, 4));
+            const __m256 radius_a = _mm256_i32gather_ps(state.radius, a, 4);
+            const __m256 radius_b = _mm256_i32gather_ps(state.radius, b, 4);
+            const __m256 contact = _mm256_add_ps(radius_a, radius_b);
+            const __m256 dist_sq = _mm256_add_ps(_mm256_mul_ps(diff_x, diff_x), _mm256_mul_ps(diff_y, diff_y));
+            const __m256 overlapping = _mm256_and_ps(_mm256_cmp_ps(dist_sq, _mm256_mul_ps(contact, contact), _CMP_LT_OQ), _mm256_cmp_ps(dist_sq, zero_8, _CMP_GT_OQ));
+            const int mask = _mm256_movemask_ps(overlapping) & getAwakeMask(i, 8);
+            if (mask == 0) {
+                continue;
+            }
+            const __m256 lanes = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_and_si256(_mm256_set1_epi32(mask), _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128)), _mm256_setzero_si256()));
+            // One Newton-Raphson step brings rsqrt close to full precision
+            __m256 inv_dist = _mm256_rsqrt_ps(dist_sq);
+            inv_dist = _mm256_mul_ps(inv_dist, _mm256_sub_ps(three_halves_8, _mm256_mul_ps(_mm256_mul_ps(half_8, dist_sq), _mm256_mul_ps(inv_dist, inv_dist))));
+            const __m256 overlap = _mm256_and_ps(lanes, _mm256_sub_ps(contact, _mm256_mul_ps(dist_sq, inv_dist)));
+            const __m256 mass_a = _mm256_mul_ps(radius_a, radius_a);
+            const __m256 mass_b = _mm256_mul_ps(radius_b, radius_b);
+            const __m256 mass = _mm256_add_ps(mass_a, mass_b);
+            const __m256 scale_a = _mm256_mul_ps(_mm256_mul_ps(overlap, _mm256_div_ps(mass_b, mass)), inv_dist);
+            const __m256 scale_b = _mm256_mul_ps(_mm256_mul_ps(overlap, _mm256_div_ps(mass_a, mass)), inv_dist);
+            const __m256 ax = _mm256_mul_ps(diff_x, scale_a);
+            const __m256 ay = _mm256_mul_ps(diff_y, scale_a);
+            const __m256 bx = _mm256_mul_ps(diff_x, scale_b);
+            const __m256 by = _mm256_mul_ps(diff_y, scale_b);
+            int wake = 0;
+            if (state.sleep_steps > 0) {
+                const __m256 largest = _mm256_max_ps(_mm256_add_ps(_mm256_mul_ps(ax, ax), _mm256_mul_ps(ay, ay)), _mm256_add_ps(_mm256_mul_ps(bx, bx), _mm256_mul_ps(by, by)));
+                wake = _mm256_movemask_ps(_mm256_cmp_ps(largest, threshold_8, _CMP_GT_OQ));
+            }
+            _mm256_store_ps(col, ax);
+            _mm256_store_ps(col + 8, ay);
+            _mm256_store_ps(col + 16, bx);
+            _mm256_store_ps(col + 24, by);
+            scatter(i, mask, wake, col);
+            stats.contacts += std::popcount(static_cast<unsigned>(mask));
+            deepest_8 = _mm256_max_ps(deepest_8, overlap);
+        }
+        alignas(32) float deepest[8];
+        _mm256_store_ps(deepest, deepest_8);
+        stats.deepest = std::max(stats.deepest, *std::max_element(deepest, deepest + 8));
+    }
+#elif defined(__SSE2__)
+    {
+        const __m128 zero_4 = _mm_setzero_ps();
+        const __m128 half_4 = _mm_set1_ps(0.5f);
+        const __m128 three_halves_4 = _mm_set1_ps(1.5f);
+        const __m128 threshold_4 = _mm_set1_ps(threshold_sq);
+        __m128 deepest_4 = zero_4;
+        alignas(16) float col[32];  // same layout as the AVX2 path, only 4 lanes used
+        for (size_t group = 0; group < batched / 4; group++) {
+            const size_t i = reverse ? batched - 4 * (group + 1) : 4 * group;
+            const ContactPair* p = pairs + i;
+            const __m128 diff_x = _mm_sub_ps(_mm_setr_ps(state.x[p[0].a], state.x[p[1].a], state.x[p[2].a], state.x[p[3].a]),
+                                             _mm_setr_ps(state.x[p[0].b], state.x[p[1].b], state.x[p[2].b], state.x[p[3].b]));
+            const __m128 diff_y = _mm_sub_ps(_mm_setr_ps(state.y[p[0].a], state.y[p[1].a], state.y[p[2].a], state.y[p[3].a]),
+                                             _mm_setr_ps(state.y[p[0].b], state.y[p[1].b], state.y[p[2].b], state.y[p[3].b]));
+            const __m128 radius_a = _mm_setr_ps(state.radius[p[0].a], state.radius[p[1].a], state.radius[p[2].a], state.radius[p[3].a]);
+            const __m128 radius_b = _mm_setr_ps(state.radius[p[0].b], state.radius[p[1].b], state.radius[p[2].b], state.radius[p[3].b]);
+            const __m128 contact = _mm_add_ps(radius_a, radius_b);
+            const __m128 dist_sq = _mm_add_ps(_mm_mul_ps(diff_x, diff_x), _mm_mul_ps(diff_y, diff_y));
+            const __m128 overlapping = _mm_and_ps(_mm_cmplt_ps(dist_sq, _mm_mul_ps(contact, contact)), _mm_cmpgt_ps(dist_sq, zero_4));
+            const int mask = _mm_movemask_ps(overlapping) & getAwakeMask(i, 4);
+            if (mask == 0) {
+                continue;
+            }
+            const __m128 lanes = _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_and_si128(_mm_set1_epi32(mask), _mm_setr_epi32(1, 2, 4, 8)), _mm_setzero_si128()));
+            __m128 inv_dist = _mm_rsqrt_ps(dist_sq);
+            inv_dist = _mm_mul_ps(inv_dist, _mm_sub_ps(three_halves_4, _mm_mul_ps(_mm_mul_ps(half_4, dist_sq), _mm_mul_ps(inv_dist, inv_dist))));
+            const __m128 overlap = _mm_and_ps(lanes, _mm_sub_ps(contact, _mm_mul_ps(dist_sq, inv_dist)));
+            const __m128 mass_a = _mm_mul_ps(radius_a, radius_a);
+            const __m128 mass_b = _mm_mul_ps(radius_b, radius_b);
+            const __m128 mass = _mm_add_ps(mass_a, mass_b);
+            const __m128 scale_a = _mm_mul_ps(_mm_mul_ps(overlap, _mm_div_ps(mass_b, mass)), inv_dist);
+            const __m128 scale_b = _mm_mul_ps(_mm_mul_ps(overlap, _mm_div_ps(mass_a, mass)), inv_dist);
+            const __m128 ax = _mm_mul_ps(diff_x, scale_a);
+            const __m128 ay = _mm_mul_ps(diff_y, scale_a);
+            const __m128 bx = _mm_mul_ps(diff_x, scale_b);
+            const __m128 by = _mm_mul_ps(diff_y, scale_b);
+            int wake = 0;
+            if (state.sleep_steps > 0) {
+                const __m128 largest = _mm_max_ps(_mm_add_ps(_mm_mul_ps(ax, ax), _mm_mul_ps(ay, ay)), _mm_add_ps(_mm_mul_ps(bx, bx), _mm_mul_ps(by, by)));
+                wake = _mm_movemask_ps(_mm_cmpgt_ps(largest, threshold_4));
+            }
+            _mm_store_ps(col, ax);
+            _mm_store_ps(col + 8, ay);
+            _mm_store_ps(col + 16, bx);
+            _mm_store_ps(col + 24, by);
+            scatter(i, mask, wake, col);
+            stats.contacts += std::popcount(static_cast<unsigned>(mask));
+            deepest_4 = _mm_max_ps(deepest_4, overlap);
+        }
+        alignas(16) float deepest[4];
+        _mm_store_ps(deepest, deepest_4);
+        stats.deepest = std::max(stats.deepest, *std::max_element(deepest, deepest + 4));
+    }
+#endif
+
+    if (!reverse) {
+        solveRemaining();
+    }
+}
@@ -0,0 +1,179 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "engine/common/vec.hpp"
+
+// Identifies a particle across reorders and removals. The id of a removed particle is given to a later one with another
+// generation, so a handle kept after a removal never reaches the new particle.
+struct ObjectHandle {
+    int id = -1;
+    uint32_t generation = 0;
+};
+
+// Physics state of every particle stored as structure of arrays, so each loop only streams the components it uses.
+// Particles can be reordered in memory, ids given by add() stay valid and map to their current index until removed.
+// Removals move the last particle into the hole, so the arrays stay dense.
+struct Particles {
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> last_x;
+    std::vector<float> last_y;
+    std::vector<float> radius;
+    std::vector<int> ids;      // id of the particle stored at each index
+    std::vector<int> indices;  // current index of each id, -1 for the ids of removed particles
+    std::vector<uint32_t> generations;  // of each id, bumped when its particle is removed
+    std::vector<int> free_ids;          // ids of removed particles, reused by the next additions
+    std::vector<uint8_t> rest;  // consecutive still substeps, the particle sleeps once it reaches the solver's sleep_steps
+
+    size_t size() const {
+        return x.size();
+    }
+
+    // Ids in use are all lower, ids of removed particles included
+    int getIdCount() const {
+        return indices.size();
+    }
+
+    bool isAlive(const ObjectHandle& handle) const {
+        return handle.id >= 0 && handle.id < getIdCount() && indices[handle.id] != -1 && generations[handle.id] == handle.generation;
+    }
+
+    ObjectHandle getHandle(int index) const {
+        const int id = ids[index];
+        return {id, generations[id]};
+    }
+
+    void reserve(size_t count) {
+        x.reserve(count);
+        y.reserve(count);
+        last_x.reserve(count);
+        last_y.reserve(count);
+        radius.reserve(count);
+        ids.reserve(count);
+        indices.reserve(count);
+        generations.reserve(count);
+        rest.reserve(count);
+    }
+
+    // Returns the id of the new particle
+    int add(const Vec2& position, const Vec2& last_position, float particle_radius = 0.5f) {
+        const int id = takeId();
+        indices[id] = x.size();
+        ids.emplace_back(id);
+        x.emplace_back(position.x);
+        y.emplace_back(position.y);
+        last_x.emplace_back(last_position.x);
+        last_y.emplace_back(last_position.y);
+        radius.emplace_back(particle_radius);
+        rest.emplace_back(0);
+        return id;
+    }
+
+    // Appends count particles for the caller to fill, every array grows at most once.
+    // Returns the index of the first new particle, the others follow.
+    int append(int count) {
+        const int first = x.size();
+        const int total = first + count;
+        x.resize(total);
+        y.resize(total);
+        last_x.resize(total);
+        last_y.resize(total);
+        radius.resize(total);
+        rest.resize(total, 0);
+        ids.resize(total);
+        for (int i = first; i < total; i++) {
+            const int id = takeId();
+            ids[i] = id;
+            indices[id] = i;
+        }
+        return first;
+    }
+
+    // Moves the last particle into the slot of the removed one. Returns that slot, which now holds the last particle
+    // unless the removed one was the last.
+    int remove(int id) {
+        const int index = indices[id];
+        const int last = x.size() - 1;
+        x[index] = x[last];
+        y[index] = y[last];
+        last_x[index] = last_x[last];
+        last_y[index] = last_y[last];
+        radius[index] = radius[last];
+        rest[index] = rest[last];
+        ids[index] = ids[last];
+        indices[ids[index]] = index;
+        x.pop_back();
+        y.pop_back();
+        last_x.pop_back();
+        last_y.pop_back();
+        radius.pop_back();
+        rest.pop_back();
+        ids.pop_back();
+
+        indices[id] = -1;
+        generations[id]++;
+        free_ids.push_back(id);
+        return index;
+    }
+
+    // Forgets every removed id, for arrays replaced by ids 0 to size() - 1
+    void resetIds() {
+        generations.assign(indices.size(), 0);
+        free_ids.clear();
+    }
+
+    // Reuses the most recently freed id first
+    int takeId() {
+        if (!free_ids.empty()) {
+            const int id = free_ids.back();
+            free_ids.pop_back();
+            return id;
+        }
+        indices.emplace_back(-1);
+        generations.emplace_back(0);
+        return indices.size() - 1;
+    }
+
+    Vec2 getPosition(int i) const {
+        return {x[i], y[i]};
+    }
+
+    Vec2 getLastPosition(int i) const {
+        return {last_x[i], last_y[i]};
+    }
+};
+
+// Gives access to a single particle, only valid until particles are added to, removed from or reordered by the solver
+struct ParticleHandle {
+    Particles& particles;
+    int index;  // current index of the particle, not its id
+
+    Vec2 getPosition() const {
+        return particles.getPosition(index);
+    }
+
+    Vec2 getLastPosition() const {
+        return particles.getLastPosition(index);
+    }
+
+    float getRadius() const {
+        return particles.radius[index];
+    }
+
+    // Moves the particle and resets its velocity, wakes it up
+    void setPosition(const Vec2& pos) {
+        particles.x[index] = pos.x;
+        particles.y[index] = pos.y;
+        particles.last_x[index] = pos.x;
+        particles.last_y[index] = pos.y;
+        particles.rest[index] = 0;
+    }
+
+    // Changes the velocity of the particle, wakes it up
+    void setLastPosition(const Vec2& pos) {
+        particles.last_x[index] = pos.x;
+        particles.last_y[index] = pos.y;
+        particles.rest[index] = 0;
+    }
+};
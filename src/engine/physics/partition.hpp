@@ -0,0 +1,205 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <span>
+#include <vector>
+
+#include "engine/common/thread_pool.hpp"
+#include "engine/common/vec.hpp"
+
+// Splits the world into tiles whose contacts are solved in parallel. The world is cut into columns along x,
+// then every column is cut into rows along y, both at particle count quantiles so dense areas get smaller tiles.
+// Tiles are colored by (column parity, row parity): two tiles of the same color are always separated by a full
+// column or row at least min_size wide, so their contacts can never touch the same particle.
+// The tiles don't depend on the worker count, so neither does the order contacts are solved in nor the result.
+struct TilePartition {
+    Vec2 world_size;
+    float min_size = 4.0f;              // smallest tile side, must stay above twice the contact distance plus the drift of a substep
+    float rebalance_threshold = 1.5f;   // rebalance once the largest tile holds that many times the average
+    int target_tiles = 256;             // tiles aimed for whatever the worker count, enough for a few per worker of a large machine
+    int x_bins;                         // unit wide bins along x used to place the boundaries
+    int y_bins;                         // unit high bins along y used to place the boundaries
+    int columns = 0;
+    int rows = 0;                       // rows of every column
+    int workers = 0;                    // worker count the tiles were built for
+    bool needs_rebalance = true;
+    std::vector<int> column_bounds;     // first x bin of every column, then x_bins
+    std::vector<int> row_bounds;        // first y bin of every row of every column, then y_bins, rows + 1 entries per column
+    std::vector<int> column_of_bin;     // column of every x bin
+    std::vector<int> tile_of_bin;       // tile of every y bin of every column, indexed by column * y_bins + y bin
+    std::vector<int> color_tiles[4];    // tiles of each color
+    std::vector<int> tile_start;        // index of the first object of each tile in tile_objects, last entry is the object count
+    std::vector<int> tile_objects;      // object ids sorted by tile, ascending inside a tile
+    std::vector<int> object_tiles;      // tile of every object
+    std::vector<int> worker_offsets;    // per worker and tile counters of the parallel counting sort
+    std::vector<int> histogram;         // scratch buffer to place the boundaries
+    std::vector<int> histogram_bounds;  // scratch buffer for the row boundaries of a column
+
+    TilePartition(const Vec2& size) : world_size{size}, x_bins{std::max(1, static_cast<int>(std::ceil(size.x)))}, y_bins{std::max(1, static_cast<int>(std::ceil(size.y)))} {}
+
+    int tileCount() const {
+        return tile_start.size() - 1;
+    }
+
+    std::span<const int> getTileObjects(int tile) const {
+        return {tile_objects.data() + tile_start[tile], tile_objects.data() + tile_start[tile + 1]};
+    }
+
+    int getBinX(float x) const {
+        return std::clamp(static_cast<int>(x), 0, x_bins - 1);
+    }
+
+    int getBinY(float y) const {
+        return std::clamp(static_cast<int>(y), 0, y_bins - 1);
+    }
+
+    // Fills bounds with parts + 1 bin boundaries splitting the histogram into parts of similar counts, each at least min_bins wide
+    static void computeSplits(const int* counts, int bins, int parts, int min_bins, std::vector<int>& bounds) {
+        bounds.assign(parts + 1, 0);
+        bounds[parts] = bins;
+        long total = 0;
+        for (int i = 0; i < bins; i++) {
+            total += counts[i];
+        }
+        long cumulated = 0;
+        int bin = 0;
+        for (int part = 1; part < parts; part++) {
+            const long target = total * part / parts;
+            while (bin < bins && cumulated + counts[bin] <= target) {
+                cumulated += counts[bin++];
+            }
+            const int lowest = bounds[part - 1] + min_bins;
+            const int highest = bins - (parts - part) * min_bins;
+            bounds[part] = total > 0 ? std::clamp(bin, lowest, highest) : part * bins / parts;
+        }
+    }
+
+    // Places the tile boundaries on the current particle distribution
+    void rebalance(const float* x, const float* y, int count, ThreadPool& pool) {
+        workers = pool.size();
+        const int min_bins = static_cast<int>(std::ceil(min_size));
+        const int max_columns = std::max(1, x_bins / min_bins);
+        const int max_rows = std::max(1, y_bins / min_bins);
+        columns = std::clamp(static_cast<int>(std::lround(std::sqrt(target_tiles * world_size.x / world_size.y))), 1, max_columns);
+        rows = std::clamp((target_tiles + columns - 1) / columns, 1, max_rows);
+
+        histogram.assign(x_bins, 0);
+        pool.parallelFor(count, [&](int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                std::atomic_ref<int>{histogram[getBinX(x[i])]}.fetch_add(1, std::memory_order_relaxed);
+            }
+        });
+        computeSplits(histogram.data(), x_bins, columns, min_bins, column_bounds);
+        column_of_bin.resize(x_bins);
+        for (int column = 0; column < columns; column++) {
+            std::fill(column_of_bin.begin() + column_bounds[column], column_of_bin.begin() + column_bounds[column + 1], column);
+        }
+
+        histogram.assign(columns * y_bins, 0);
+        pool.parallelFor(count, [&](int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                const int column = column_of_bin[getBinX(x[i])];
+                std::atomic_ref<int>{histogram[column * y_bins + getBinY(y[i])]}.fetch_add(1, std::memory_order_relaxed);
+            }
+        });
+        row_bounds.resize(columns * (rows + 1));
+        for (int column = 0; column < columns; column++) {
+            computeSplits(histogram.data() + column * y_bins, y_bins, rows, min_bins, histogram_bounds);
+            std::copy(histogram_bounds.begin(), histogram_bounds.end(), row_bounds.begin() + column * (rows + 1));
+        }
+        applyBounds();
+    }
+
+    // Rebuilds the tiles from column_bounds and row_bounds, set by rebalance or restored from a snapshot
+    void applyBounds() {
+        column_of_bin.resize(x_bins);
+        for (int column = 0; column < columns; column++) {
+            std::fill(column_of_bin.begin() + column_bounds[column], column_of_bin.begin() + column_bounds[column + 1], column);
+        }
+        tile_of_bin.resize(columns * y_bins);
+        for (auto& tiles : color_tiles) {
+            tiles.clear();
+        }
+        int tile = 0;
+        for (int column = 0; column < columns; column++) {
+            const int* bounds = row_bounds.data() + column * (rows + 1);
+            for (int row = 0; row < rows; row++) {
+                std::fill(tile_of_bin.begin() + column * y_bins + bounds[row], tile_of_bin.begin() + column * y_bins + bounds[row + 1], tile);
+                color_tiles[(column & 1) * 2 + (row & 1)].emplace_back(tile);
+                tile++;
+            }
+        }
+        tile_start.assign(tile + 1, 0);
+        needs_rebalance = false;
+    }
+
+    // Checks bounds read from a file before they are applied: both must split all the bins in increasing order
+    bool validBounds(int column_count, int row_count, const std::vector<int>& saved_columns, const std::vector<int>& saved_rows) const {
+        const auto splits = [](const int* bounds, int parts, int bins) {
+            if (bounds[0] != 0 || bounds[parts] != bins) {
+                return false;
+            }
+            for (int part = 0; part < parts; part++) {
+                if (bounds[part] >= bounds[part + 1]) {
+                    return false;
+                }
+            }
+            return true;
+        };
+        if (column_count < 1 || row_count < 1 || column_count > x_bins || row_count > y_bins || saved_columns.size() != static_cast<size_t>(column_count + 1) || saved_rows.size() != static_cast<size_t>(column_count * (row_count + 1))) {
+            return false;
+        }
+        if (!splits(saved_columns.data(), column_count, x_bins)) {
+            return false;
+        }
+        for (int column = 0; column < column_count; column++) {
+            if (!splits(saved_rows.data() + column * (row_count + 1), row_count, y_bins)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Sorts the objects by tile with a stable parallel counting sort, then checks if the tiles are still balanced.
+    // The pool must have the worker count of the last rebalance.
+    void assign(const float* x, const float* y, int count, ThreadPool& pool) {
+        const int tiles = tileCount();
+        object_tiles.resize(count);
+        worker_offsets.assign(tiles * workers, 0);
+        pool.parallelFor(count, [&](int begin, int end, int worker) {
+            int* counts = worker_offsets.data() + worker * tiles;
+            for (int i = begin; i < end; i++) {
+                const int tile = tile_of_bin[column_of_bin[getBinX(x[i])] * y_bins + getBinY(y[i])];
+                object_tiles[i] = tile;
+                counts[tile]++;
+            }
+        });
+
+        // Objects of a tile are laid out by worker, and workers got their ranges in order, so ids stay ascending
+        int offset = 0;
+        int largest = 0;
+        for (int tile = 0; tile < tiles; tile++) {
+            tile_start[tile] = offset;
+            for (int worker = 0; worker < workers; worker++) {
+                const int tile_count = worker_offsets[worker * tiles + tile];
+                worker_offsets[worker * tiles + tile] = offset;
+                offset += tile_count;
+            }
+            largest = std::max(largest, offset - tile_start[tile]);
+        }
+        tile_start[tiles] = offset;
+
+        tile_objects.resize(count);
+        pool.parallelFor(count, [&](int begin, int end, int worker) {
+            int* offsets = worker_offsets.data() + worker * tiles;
+            for (int i = begin; i < end; i++) {
+                tile_objects[offsets[object_tiles[i]]++] = i;
+            }
+        });
+
+        if (tiles > 1 && largest > rebalance_threshold * count / tiles) {
+            needs_rebalance = true;
+        }
+    }
+};
@@ -1,133 +1,966 @@
 #pragma once
+#include <algorithm>
+#include <atomic>
 #include <cmath>
-#include <future>
+#include <optional>
+#include <span>
 #include <vector>
 
+#include "engine/common/grid.hpp"
+#include "engine/common/morton.hpp"
+#include "engine/common/multi_grid.hpp"
+#include "engine/common/profiler.hpp"
 #include "engine/common/quadtree.hpp"
+#include "engine/common/thread_pool.hpp"
 #include "engine/common/vec.hpp"
+#include "constraints.hpp"
+#include "integrator.hpp"
+#include "narrowphase.hpp"
+#include "partition.hpp"
+#include "particles.hpp"
 #include "physics_object.hpp"
 
+enum class Broadphase {
+    QuadTree,
+    Grid,
+    MultiGrid,  // one grid per radius class, for scenes mixing small and big balls
+};
+
+enum class ContactSolver {
+    GaussSeidel,  // pairs of a tile applied one after another, tiles of a color in parallel
+    Jacobi,       // corrections of every particle summed from the same positions then applied at once, same result on any thread count
+};
+
 struct PhysicsSolver {
+    ThreadPool pool;
+    Profiler profiler;  // phase timings and counters of every update, disabled by default
     QuadTree qtree;
-    std::vector<PhysicsObject> objects;
+    UniformGrid grid;
+    MultiLevelGrid multi_grid;
+    Broadphase broadphase;
+    Particles particles;
+    std::vector<sf::Color> colors;  // render only, kept out of the particle arrays
     Vec2 world_size;
     Vec2 gravity = {0.0f, 20.0f};
     int sub_steps;
+    int solver_iterations = 2;  // passes over the pair lists per substep, one forward and one reverse keep deep piles still
+    ContactSolver contact_solver = ContactSolver::GaussSeidel;
+    float jacobi_relaxation = 0.5f;  // factor of the summed corrections applied by the Jacobi solver
+    bool batched_narrowphase = true;  // Gauss-Seidel solves conflict free groups of pairs with SIMD when the compiler targets it
+    float batch_touching_share = 0.25f;  // share of a tile's pairs touching when its list is built, below it the tile is solved
+                                        // scalar since the SIMD groups would mostly test pairs the scalar loop skips early
+    int64_t narrowphase_ns = 0;       // time spent solving contacts during the last update
+    DistanceConstraints constraints;
+    size_t constraint_count = 0;  // links solved during the last update, once per iteration
+    int64_t constraints_ns = 0;   // time spent solving links during the last update
+    size_t collision_count = 0;  // contacts solved during the last update, once per iteration
+    bool incremental_index = true;  // only move the objects that left their leaf or cell instead of rebuilding the index every substep
+    size_t moved_count = 0;         // objects inserted or moved in the index during the last update
+    int indexed_count = 0;          // particles already inserted in the quadtree
+    TilePartition partition;
+    std::vector<size_t> tile_collisions;  // contacts solved by each tile during the current substep
+    std::vector<std::vector<ContactPair>> tile_pairs;  // candidate pairs of each tile, reused while no particle moved more than half the skin
+    std::vector<size_t> tile_batched;  // leading pairs of each tile forming conflict free groups for the batched narrowphase
+    std::vector<std::vector<ContactPair>> worker_pair_scratch;
+    std::vector<std::vector<uint8_t>> worker_pair_busy;  // open groups holding each particle, see batchContactPairs
+    std::vector<size_t> worker_candidates;
+    float pair_skin = 0.3f;     // extra distance kept in the pair lists so they stay valid for a few substeps
+    bool pairs_valid = false;   // false when the pair lists must be built again at the next substep
+    std::vector<float> pair_x;  // particle positions when the pair lists were built
+    std::vector<float> pair_y;
+    std::vector<float> worker_displacement;  // largest squared displacement seen by each worker
+    size_t pair_count = 0;      // candidate pairs in the current lists
+    size_t candidate_count = 0;  // pairs returned by the broadphase queries of the last pair build, before the distance test
+    float max_radius = 0.5f;     // largest particle radius ever added, bounds the reach of the broadphase queries
+    float wall_margin = 0.5f;    // gap between the world border and the walls
+    int pair_builds = 0;        // pair lists built during the last update
+    int reorder_interval = 0;           // frames between two reorders of the particles along a Morton curve, 0 disables them
+    float reorder_locality_factor = 0.0f;  // also reorder once pair_locality grows past this factor of its value after the last reorder, 0 disables it
+    float pair_locality = 0.0f;         // mean index distance between the two particles of a pair, grows as particles mix
+    float reordered_locality = 0.0f;    // pair_locality measured right after the last reorder
+    int frames_since_reorder = 0;
+    std::vector<uint64_t> reorder_keys;  // Morton code and index of every particle
+    std::vector<float> reorder_floats;   // scratch buffers to gather the particle arrays
+    std::vector<int> reorder_ints;
+    std::vector<uint8_t> reorder_bytes;
+    std::vector<sf::Color> reorder_colors;
+    int sleep_steps = 0;             // still substeps before a particle sleeps (at most 255), 0 disables sleeping
+    float sleep_speed = 1.0f;        // speed in units per second under which a supported particle is still
+    float sleep_threshold = 0.0f;    // displacement per substep of sleep_speed plus the pull of gravity, set by update(), larger contact corrections wake particles up
+    std::vector<uint8_t> contact_support;  // particles of an overlapping pair during the current substep, only those and the ones on the floor can fall asleep
+    int sleeping_count = 0;          // particles asleep after the last update
+    std::vector<int> worker_sleeping;
+    std::vector<std::vector<int>> tile_neighbours;  // other tiles holding a particle of the pairs of each tile
+    std::vector<uint8_t> tile_awake;                // tiles with an awake particle during the current substep
+    std::vector<QueryCircle> removed_areas;         // particles removed since the last update, the sleeping ones they held up are woken
+    std::vector<int> wake_queue;
+    static constexpr int sleep_block_size = 64;
+    std::vector<uint8_t> awake_blocks;  // blocks of sleep_block_size particles integrated during the last substep, the others only hold sleeping particles resting on their last position
+    bool adaptive_sub_steps = false;  // picks sub_steps at every update from the motion measured during the previous one
+    int min_sub_steps = 2;
+    int max_sub_steps = 16;
+    float target_displacement = 0.25f;  // largest displacement of a particle per substep aimed for by the adaptive mode
+    float target_overlap = 0.1f;        // deepest contact overlap aimed for by the adaptive mode
+    int calm_frames_before_step_down = 60;  // updates in a row one substep fewer must look safe for before the count goes down
+    int calm_frames = 0;                // updates in a row one substep fewer looked safe for
+    float step_displacement = 0.0f;     // largest displacement of a particle during the last substep of the last update
+    float step_overlap = 0.0f;          // deepest overlap solved during the last substep of the last update
+    std::vector<float> tile_overlap;    // deepest overlap solved by each tile during the current substep
+    std::vector<int> contact_offsets;     // candidates of particle i are contact_neighbours[contact_offsets[i], contact_offsets[i + 1])
+    std::vector<int> contact_neighbours;  // both particles of every pair, sorted per particle
+    std::vector<int> contact_cursors;
+    bool neighbours_valid = false;        // false when the neighbour lists must be built again from the pair lists
+    std::vector<float> jacobi_dx;         // corrections summed for each particle by the Jacobi solver
+    std::vector<float> jacobi_dy;
+    std::vector<uint8_t> jacobi_wake;     // particles woken up by a large correction
+    std::vector<size_t> worker_contacts;
+    std::vector<float> worker_overlap;
+    int layout_version = 0;             // changes whenever particles move to other indices, so per index caches know to refresh
+    bool needs_index_reset = false;     // particles were removed, the index is rebuilt at the next update
+
+    // A thread count of 0 uses one worker per hardware thread
+    PhysicsSolver(const Vec2& size, Broadphase _broadphase = Broadphase::QuadTree, int threads = 0)
+        : pool{threads}, profiler{pool.size()}, qtree{size}, grid{size}, multi_grid{size}, broadphase{_broadphase}, world_size{size}, sub_steps{8}, partition{size} {}
 
-    PhysicsSolver(const Vec2& size) : qtree{size}, world_size{size}, sub_steps{8} {}
+    ObjectHandle addObject(const PhysicsObject& object) {
+        colors.emplace_back(object.color);
+        const int id = particles.add(object.position, object.last_position, object.radius);
+        growRadius(object.radius);
+        return {id, particles.generations[id]};
+    }
 
-    int addObject(const PhysicsObject& object) {
-        objects.emplace_back(object);
-        return objects.size() - 1;
+    // Adds every object at once, filling the arrays with every worker. Returns the index of the first object, the others
+    // follow in order, getHandle() gives their handles.
+    int addObjects(std::span<const PhysicsObject> objects) {
+        const int first = particles.append(objects.size());
+        colors.resize(particles.size());
+        pool.parallelFor(objects.size(), [&](int begin, int end) {
+            for (int k = begin; k < end; k++) {
+                const PhysicsObject& object = objects[k];
+                const int i = first + k;
+                particles.x[i] = object.position.x;
+                particles.y[i] = object.position.y;
+                particles.last_x[i] = object.last_position.x;
+                particles.last_y[i] = object.last_position.y;
+                particles.radius[i] = object.radius;
+                colors[i] = object.color;
+            }
+        });
+        for (const PhysicsObject& object : objects) {
+            growRadius(object.radius);
+        }
+        return first;
     }
 
-    int createObject(const Vec2& pos) {
-        objects.emplace_back(PhysicsObject{pos});
-        return objects.size() - 1;
+    ObjectHandle createObject(const Vec2& pos, float radius = 0.5f) {
+        colors.emplace_back();
+        const int id = particles.add(pos, pos, radius);
+        growRadius(radius);
+        return {id, particles.generations[id]};
     }
 
-    void addObjectsToTree() {
-        qtree.clear();
-        for (int i = qtree.objects.size(); i < objects.size(); i++) {
-            const PhysicsObject& obj = objects[i];
-            if (obj.position.x > 0.0f && obj.position.x < world_size.x && obj.position.y > 0.0f && obj.position.y < world_size.y) {
-                qtree.insert(obj.position, i);
+    // Tiles of the same color must stay further apart than the reach of a pair, plus the drift of a substep
+    void growRadius(float radius) {
+        if (radius <= max_radius) {
+            return;
+        }
+        max_radius = radius;
+        partition.min_size = std::max(partition.min_size, 2.0f * (2.0f * max_radius + pair_skin) + 1.0f);
+        partition.needs_rebalance = true;
+        pairs_valid = false;
+    }
+
+    // Links two particles at their current distance. Returns false when one of them was removed or they already have
+    // too many links.
+    bool addLink(const ObjectHandle& a, const ObjectHandle& b, float stiffness = 1.0f, float break_strain = 0.0f) {
+        if (!particles.isAlive(a) || !particles.isAlive(b) || a.id == b.id) {
+            return false;
+        }
+        const Vec2 diff = particles.getPosition(particles.indices[a.id]) - particles.getPosition(particles.indices[b.id]);
+        return constraints.add({a, b, std::sqrt(diff.x * diff.x + diff.y * diff.y), stiffness, break_strain});
+    }
+
+    ObjectHandle getHandle(int index) const {
+        return particles.getHandle(index);
+    }
+
+    // The id must belong to a particle that wasn't removed
+    ParticleHandle getObject(int id) {
+        return ParticleHandle{particles, particles.indices[id]};
+    }
+
+    std::optional<ParticleHandle> getObject(const ObjectHandle& handle) {
+        if (!particles.isAlive(handle)) {
+            return std::nullopt;
+        }
+        return ParticleHandle{particles, particles.indices[handle.id]};
+    }
+
+    // Removes the particle in O(1) by moving the last one into its slot, the index is rebuilt once at the next update
+    // whatever the number of removals. Returns false when the handle is stale.
+    bool removeObject(const ObjectHandle& handle) {
+        if (!particles.isAlive(handle)) {
+            return false;
+        }
+        if (sleep_steps > 0) {
+            const int removed = particles.indices[handle.id];
+            removed_areas.push_back({particles.getPosition(removed), particles.radius[removed]});
+        }
+        const int index = particles.remove(handle.id);
+        colors[index] = colors.back();
+        colors.pop_back();
+        layout_version++;
+        pairs_valid = false;
+        needs_index_reset = true;
+        return true;
+    }
+
+    void addObjectsToIndex(QuadTree& index) {
+        if (incremental_index) {
+            pool.parallelFor(index.objects.size(), [&](int begin, int end) {
+                for (int i = begin; i < end; i++) {
+                    QuadObject& obj = index.objects[i];
+                    obj.position = particles.getPosition(obj.id);
+                }
+            });
+            moved_count += index.updateLeafs();
+            index.cleanup();
+            // New particles are always inserted, the tree keeps the ones outside the world in its border leaves
+            index.insert(particles.x.data(), particles.y.data(), indexed_count, particles.size());
+        } else {
+            index.clear();
+            const int count = particles.size();
+            for (int i = 0; i < count; i++) {
+                const Vec2 position = particles.getPosition(i);
+                if (position.x > 0.0f && position.x < world_size.x && position.y > 0.0f && position.y < world_size.y) {
+                    index.insert(position, i);
+                }
             }
+            moved_count += particles.size();
+        }
+        indexed_count = particles.size();
+    }
+
+    void addObjectsToIndex(UniformGrid& index) {
+        if (incremental_index) {
+            moved_count += index.update(particles.x.data(), particles.y.data(), particles.size(), pool);
+        } else {
+            index.build(particles.x.data(), particles.y.data(), particles.size(), pool);
+            moved_count += particles.size();
         }
+        indexed_count = particles.size();
     }
 
-    void solveContact(int obj_1_idx, int obj_2_idx) {
-        PhysicsObject& obj_1 = objects[obj_1_idx];
-        PhysicsObject& obj_2 = objects[obj_2_idx];
-        const Vec2 diff = obj_1.position - obj_2.position;
-        const float dist_2 = std::sqrt(diff.x * diff.x + diff.y * diff.y);
-        // Radius are all equal to 1.0f
-        const float delta = 0.5f * (1.0f - dist_2);
-        const Vec2& col_vec = (diff / dist_2) * delta;
-        obj_1.position += col_vec;
-        obj_2.position -= col_vec;
+    // Rebuilt whenever the pair lists are, which is already rare compared to substeps
+    void addObjectsToIndex(MultiLevelGrid& index) {
+        index.clear();
+        const int count = particles.size();
+        for (int i = 0; i < count; i++) {
+            index.insert(particles.getPosition(i), particles.radius[i], i);
+        }
+        index.build();
+        moved_count += particles.size();
+        indexed_count = particles.size();
     }
 
-    std::vector<QuadCell> generateQuadCells(int n, float screenWidth, float screenHeight) {
-        std::vector<QuadCell> cells;
+    // Calls visit(j) for every particle that may be closer to particle i than their contact distance plus the skin
+    template <typename Index, typename Visitor>
+    void forEachCandidate(const Index& index, int i, Visitor&& visit) const {
+        index.forEach(QueryCircle{particles.getPosition(i), particles.radius[i] + max_radius + pair_skin}, visit);
+    }
 
-        float cellWidth = screenWidth / n;
+    template <typename Visitor>
+    void forEachCandidate(const MultiLevelGrid& index, int i, Visitor&& visit) const {
+        index.forEach(particles.getPosition(i), particles.radius[i] + pair_skin, visit);
+    }
 
-        for (int i = 0; i < n; ++i) {
-            float cellX = i * cellWidth + cellWidth / 2.0f;
-            float cellY = screenHeight / 2.0f;
+    // Calls visit(j) for every particle that may be closer to position than reach plus its radius
+    template <typename Index, typename Visitor>
+    void forEachNear(const Index& index, const Vec2& position, float reach, Visitor&& visit) const {
+        index.forEach(QueryCircle{position, reach + max_radius}, visit);
+    }
 
-            Vec2 cellPosition(cellX, cellY);
-            QuadCell cell(cellPosition, cellWidth, screenHeight);
+    template <typename Visitor>
+    void forEachNear(const MultiLevelGrid& index, const Vec2& position, float reach, Visitor&& visit) const {
+        index.forEach(position, reach, visit);
+    }
 
-            cells.push_back(cell);
+    // Wakes the sleeping particles touching a removed one, then the sleeping particles above a woken one, which may rest
+    // on it, so nothing stays pinned once its support is gone. Runs once the index holds the particles left.
+    template <typename Index>
+    void wakeRemovedSupport(const Index& index) {
+        wake_queue.clear();
+        const auto wakeTouching = [&](const Vec2& position, float radius, bool above_only) {
+            forEachNear(index, position, radius + pair_skin, [&](int j) {
+                if (particles.rest[j] < sleep_steps) {
+                    return;
+                }
+                const float dx = particles.x[j] - position.x;
+                const float dy = particles.y[j] - position.y;
+                const float range = radius + pair_skin + particles.radius[j];
+                if (dx * dx + dy * dy >= range * range || (above_only && dx * gravity.x + dy * gravity.y >= 0.0f)) {
+                    return;
+                }
+                particles.rest[j] = 0;
+                awake_blocks[j / sleep_block_size] = 1;
+                wake_queue.push_back(j);
+            });
+        };
+        for (const QueryCircle& area : removed_areas) {
+            wakeTouching(area.position, area.radius, false);
+        }
+        removed_areas.clear();
+        for (size_t k = 0; k < wake_queue.size(); k++) {
+            const int i = wake_queue[k];
+            wakeTouching(particles.getPosition(i), particles.radius[i], true);
         }
+    }
+
+    ContactState getContactState() {
+        return {particles.x.data(), particles.y.data(), particles.radius.data(), particles.rest.data(), contact_support.data(), sleep_steps, sleep_threshold};
+    }
+
+    // Returns the overlap of the particles before the correction, 0 when they don't overlap
+    float solveContact(int obj_1_idx, int obj_2_idx) {
+        return solveContactPair(getContactState(), obj_1_idx, obj_2_idx);
+    }
 
-        return cells;
+    // The pair lists stay valid while no particle moved more than half the skin since they were built,
+    // two particles can't have come closer than the skin in that time
+    bool pairsNeedRebuild() {
+        ProfileScope scope{profiler, "pairs_check"};
+        if (!pairs_valid || pair_x.size() != particles.size()) {
+            return true;
+        }
+        worker_displacement.assign(pool.size(), 0.0f);
+        parallelForMoving([&](int begin, int end, int worker) {
+            float largest = 0.0f;
+            for (int i = begin; i < end; i++) {
+                const float dx = particles.x[i] - pair_x[i];
+                const float dy = particles.y[i] - pair_y[i];
+                largest = std::max(largest, dx * dx + dy * dy);
+            }
+            worker_displacement[worker] = std::max(worker_displacement[worker], largest);
+        });
+        const float largest = *std::max_element(worker_displacement.begin(), worker_displacement.end());
+        return 4.0f * largest >= pair_skin * pair_skin;
     }
 
-    void solveCollisions() {
-        const auto solve_objects = [&](const std::vector<int>& indicies) {
-            for (const int i : indicies) {
-                const std::vector<int>& found_ids = qtree.query(objects[i]);
-                for (const int found_id : found_ids) {
-                    if (found_id != i) {
-                        solveContact(found_id, i);
+    // Broadphase: every pair closer than the contact distance plus the skin is stored once, in the tile of its lowest id.
+    // Pairs are sorted then grouped for the batched narrowphase, so the result doesn't depend on the order in which
+    // the broadphase returns them.
+    template <typename Index>
+    void findPairs(Index& index) {
+        {
+            ProfileScope scope{profiler, "index"};
+            addObjectsToIndex(index);
+        }
+        {
+            ProfileScope scope{profiler, "partition"};
+            partition.assign(particles.x.data(), particles.y.data(), particles.size(), pool);
+        }
+        const int tiles = partition.tileCount();
+        tile_pairs.resize(tiles);
+        tile_batched.assign(tiles, 0);
+        tile_neighbours.resize(tiles);
+        worker_pair_scratch.resize(pool.size());
+        worker_pair_busy.resize(pool.size());
+        if (batched_narrowphase) {
+            for (std::vector<uint8_t>& busy : worker_pair_busy) {
+                busy.resize(particles.size(), 0);
+            }
+        }
+        worker_candidates.assign(pool.size(), 0);
+
+        pool.parallelTasks(tiles, [&](int tile, int worker) {
+            ProfileScope scope{profiler, "pairs", worker, tile};
+            std::vector<ContactPair>& pairs = tile_pairs[tile];
+            pairs.clear();
+            size_t candidates = 0;
+            size_t touching = 0;
+            for (const int i : partition.getTileObjects(tile)) {
+                const size_t first = pairs.size();
+                const float x = particles.x[i];
+                const float y = particles.y[i];
+                const float radius = particles.radius[i] + pair_skin;
+                forEachCandidate(index, i, [&](int j) {
+                    if (j <= i) {
+                        return;
+                    }
+                    candidates++;
+                    const float dx = particles.x[j] - x;
+                    const float dy = particles.y[j] - y;
+                    const float range = radius + particles.radius[j];
+                    const float distance2 = dx * dx + dy * dy;
+                    if (distance2 < range * range) {
+                        pairs.push_back({i, j});
+                        const float contact = range - pair_skin;
+                        touching += distance2 < contact * contact;
                     }
+                });
+                std::sort(pairs.begin() + first, pairs.end(), [](const ContactPair& p1, const ContactPair& p2) { return p1.b < p2.b; });
+            }
+            std::vector<int>& neighbours = tile_neighbours[tile];
+            neighbours.clear();
+            for (const ContactPair& pair : pairs) {
+                if (partition.object_tiles[pair.b] != tile) {
+                    neighbours.push_back(partition.object_tiles[pair.b]);
                 }
             }
-        };
+            std::sort(neighbours.begin(), neighbours.end());
+            neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+            if (batched_narrowphase && touching >= batch_touching_share * pairs.size()) {
+                tile_batched[tile] = batchContactPairs(pairs, worker_pair_scratch[worker], worker_pair_busy[worker]);
+            }
+            worker_candidates[worker] += candidates;
+        });
+
+        pair_x = particles.x;
+        pair_y = particles.y;
+        pair_count = 0;
+        candidate_count = 0;
+        for (const size_t candidates : worker_candidates) {
+            candidate_count += candidates;
+        }
+        double distance = 0.0;
+        for (const auto& pairs : tile_pairs) {
+            pair_count += pairs.size();
+            for (const ContactPair& pair : pairs) {
+                distance += pair.b - pair.a;
+            }
+        }
+        pair_locality = pair_count > 0 ? distance / pair_count : 0.0f;
+        if (reordered_locality == 0.0f) {
+            reordered_locality = pair_locality;
+        }
+        pairs_valid = true;
+        neighbours_valid = false;
+        pair_builds++;
+    }
+
+    void findPairs() {
+        if (broadphase == Broadphase::Grid) {
+            findPairs(grid);
+        } else if (broadphase == Broadphase::MultiGrid) {
+            findPairs(multi_grid);
+        } else {
+            findPairs(qtree);
+        }
+    }
+
+    // Builds the pair lists from the positions they were built at by the run that saved a snapshot, on its restored
+    // tiles, so the loaded run solves the same pairs in the same order and rebuilds them at the same substeps
+    void restorePairs(std::vector<float> x, std::vector<float> y) {
+        particles.x.swap(x);
+        particles.y.swap(y);
+        findPairs();
+        particles.x.swap(x);
+        particles.y.swap(y);
+    }
+
+    // Turns the pair lists into one list of candidates per particle, sorted so summing the corrections of a particle
+    // always follows the same order whatever tiles the pairs came from
+    void buildNeighbourLists() {
+        ProfileScope scope{profiler, "neighbours"};
+        const int count = particles.size();
+        contact_offsets.assign(count + 1, 0);
+        pool.parallelTasks(tile_pairs.size(), [&](int tile) {
+            for (const ContactPair& pair : tile_pairs[tile]) {
+                std::atomic_ref<int>{contact_offsets[pair.a + 1]}.fetch_add(1, std::memory_order_relaxed);
+                std::atomic_ref<int>{contact_offsets[pair.b + 1]}.fetch_add(1, std::memory_order_relaxed);
+            }
+        });
+        for (int i = 0; i < count; i++) {
+            contact_offsets[i + 1] += contact_offsets[i];
+        }
+
+        // Filled in any order through per particle cursors, then sorted
+        contact_neighbours.resize(contact_offsets[count]);
+        std::vector<int>& cursors = contact_cursors;
+        cursors.assign(contact_offsets.begin(), contact_offsets.end() - 1);
+        pool.parallelTasks(tile_pairs.size(), [&](int tile) {
+            for (const ContactPair& pair : tile_pairs[tile]) {
+                contact_neighbours[std::atomic_ref<int>{cursors[pair.a]}.fetch_add(1, std::memory_order_relaxed)] = pair.b;
+                contact_neighbours[std::atomic_ref<int>{cursors[pair.b]}.fetch_add(1, std::memory_order_relaxed)] = pair.a;
+            }
+        });
+        pool.parallelFor(count, [&](int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                std::sort(contact_neighbours.begin() + contact_offsets[i], contact_neighbours.begin() + contact_offsets[i + 1]);
+            }
+        });
+        neighbours_valid = true;
+    }
+
+    // Flags the tiles of the pair lists holding at least one awake particle
+    void markAwakeTiles() {
+        ProfileScope scope{profiler, "sleep_tiles"};
+        tile_awake.assign(tile_pairs.size(), 0);
+        parallelForMoving([&](int begin, int end, int) {
+            for (int i = begin; i < end; i++) {
+                if (particles.rest[i] < sleep_steps) {
+                    std::atomic_ref<uint8_t>{tile_awake[partition.object_tiles[i]]}.store(1, std::memory_order_relaxed);
+                }
+            }
+        });
+    }
+
+    // A tile without awake particles still has to be solved when one of its pairs reaches an awake particle of another tile
+    bool isTileAwake(int tile) const {
+        if (tile_awake[tile]) {
+            return true;
+        }
+        return std::any_of(tile_neighbours[tile].begin(), tile_neighbours[tile].end(), [&](int neighbour) { return tile_awake[neighbour] != 0; });
+    }
+
+    // Narrowphase: solves the pairs that overlap, each pair once per pass. A single pass in a fixed order lets deep piles
+    // build up motion, so passes alternate between forward and reverse order, colors included, and two of them in a row
+    // act as one symmetric pass.
+    void solveCollisions(bool reverse) {
+        tile_collisions.assign(tile_pairs.size(), 0);
+        tile_overlap.assign(tile_pairs.size(), 0.0f);
+
+        // Tiles of the same color are never adjacent, so they can be solved at the same time
+        for (int color = 0; color < 4; color++) {
+            const std::vector<int>& tiles = partition.color_tiles[reverse ? 3 - color : color];
+            if (tiles.empty()) {
+                continue;
+            }
+            pool.parallelTasks(tiles.size(), [&](int task, int worker) {
+                const int tile = tiles[task];
+                if (sleep_steps > 0 && !isTileAwake(tile)) {
+                    return;
+                }
+                ProfileScope scope{profiler, "collisions", worker, tile};
+                const std::vector<ContactPair>& pairs = tile_pairs[tile];
+                ContactStats stats;
+                solveContactPairs(getContactState(), pairs.data(), batched_narrowphase ? tile_batched[tile] : 0, pairs.size(), reverse, stats);
+                tile_collisions[tile] = stats.contacts;
+                tile_overlap[tile] = stats.deepest;
+            });
+        }
+
+        for (const size_t count : tile_collisions) {
+            collision_count += count;
+        }
+        for (const float overlap : tile_overlap) {
+            step_overlap = std::max(step_overlap, overlap);
+        }
+    }
 
-        std::vector<QuadCell> thread_cells = generateQuadCells(8, 150, 150);
-        std::vector<std::future<void>> cell_futures = std::vector<std::future<void>>(thread_cells.size());
-        std::vector<std::vector<int>> vec_of_vecint;
+    // Narrowphase without coloring: every particle sums the corrections of its contacts from positions nobody writes,
+    // then all of them are applied, scaled by jacobi_relaxation. Each particle is only written by the worker owning it
+    // and sums in the order of its sorted neighbours, so the result is the same for any thread count.
+    void solveCollisionsJacobi() {
+        if (!neighbours_valid) {
+            buildNeighbourLists();
+        }
+        const int count = particles.size();
+        jacobi_dx.resize(count);
+        jacobi_dy.resize(count);
+        jacobi_wake.resize(count);
+        worker_contacts.assign(pool.size(), 0);
+        worker_overlap.assign(pool.size(), 0.0f);
+        const float threshold_sq = sleep_threshold * sleep_threshold;
+        pool.parallelFor(count, [&](int begin, int end, int worker) {
+            ProfileScope scope{profiler, "jacobi", worker};
+            size_t contacts = 0;
+            float deepest = 0.0f;
+            for (int i = begin; i < end; i++) {
+                const bool asleep = sleep_steps > 0 && particles.rest[i] >= sleep_steps;
+                float dx = 0.0f;
+                float dy = 0.0f;
+                uint8_t wake = 0;
+                uint8_t supported = 0;
+                for (int k = contact_offsets[i]; k < contact_offsets[i + 1]; k++) {
+                    const int j = contact_neighbours[k];
+                    // Two sleeping particles already rest against each other
+                    if (asleep && particles.rest[j] >= sleep_steps) {
+                        continue;
+                    }
+                    const float diff_x = particles.x[i] - particles.x[j];
+                    const float diff_y = particles.y[i] - particles.y[j];
+                    const float dist_sq = diff_x * diff_x + diff_y * diff_y;
+                    const float contact = particles.radius[i] + particles.radius[j];
+                    if (dist_sq >= contact * contact || dist_sq == 0.0f) {
+                        continue;
+                    }
+                    // The share of particle i in the same correction as solveContact
+                    const float dist = std::sqrt(dist_sq);
+                    const float mass_i = particles.radius[i] * particles.radius[i];
+                    const float mass_j = particles.radius[j] * particles.radius[j];
+                    const float delta = (contact - dist) * (mass_j / (mass_i + mass_j));
+                    const float col_x = (diff_x / dist) * delta;
+                    const float col_y = (diff_y / dist) * delta;
+                    dx += col_x;
+                    dy += col_y;
+                    wake |= col_x * col_x + col_y * col_y > threshold_sq;
+                    supported = 1;
+                    // Counted from the side of the lowest index only
+                    if (i < j) {
+                        contacts++;
+                        deepest = std::max(deepest, contact - dist);
+                    }
+                }
+                jacobi_dx[i] = dx;
+                jacobi_dy[i] = dy;
+                jacobi_wake[i] = wake;
+                if (sleep_steps > 0 && supported) {
+                    contact_support[i] = 1;
+                }
+            }
+            worker_contacts[worker] = contacts;
+            worker_overlap[worker] = deepest;
+        });
+        pool.parallelFor(count, [&](int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                particles.x[i] += jacobi_relaxation * jacobi_dx[i];
+                particles.y[i] += jacobi_relaxation * jacobi_dy[i];
+                if (sleep_steps > 0 && jacobi_wake[i]) {
+                    particles.rest[i] = 0;
+                }
+            }
+        });
 
-        for (const auto& cell : thread_cells) {
-            vec_of_vecint.emplace_back(qtree.query(cell));
+        for (const size_t contacts : worker_contacts) {
+            collision_count += contacts;
         }
+        for (const float overlap : worker_overlap) {
+            step_overlap = std::max(step_overlap, overlap);
+        }
+    }
 
-        for (int i = 0; i < cell_futures.size(); i += 2) {
-            cell_futures[i] = std::async(std::launch::async, solve_objects, vec_of_vecint[i]);
+    // Links of a color share no particle, so they are solved in parallel one color after another.
+    // Links found broken, or whose particle was removed, are dropped once every color is done.
+    void solveConstraints() {
+        for (size_t color = 0; color < constraints.color_links.size(); color++) {
+            const std::vector<DistanceLink>& links = constraints.color_links[color];
+            std::vector<uint8_t>& broken = constraints.color_broken[color];
+            broken.assign(links.size(), 0);
+            pool.parallelFor(links.size(), [&](int begin, int end, int worker) {
+                ProfileScope scope{profiler, "constraints", worker};
+                for (int i = begin; i < end; i++) {
+                    broken[i] = !solveDistanceLink(particles, links[i], sleep_steps, sleep_threshold);
+                }
+            });
+            constraint_count += links.size();
         }
+        constraints.removeBroken();
+    }
 
-        for (int i = 0; i < cell_futures.size(); i += 2) {
-            cell_futures[i].wait();
+    bool needsReorder() const {
+        if (reorder_interval > 0 && frames_since_reorder >= reorder_interval) {
+            return true;
         }
+        return reorder_locality_factor > 0.0f && reordered_locality > 0.0f && pair_locality > reorder_locality_factor * reordered_locality;
+    }
+
+    // Drops every structure holding particle indices, to be called once the particle arrays were replaced or permuted
+    void resetIndex() {
+        layout_version++;
+        needs_index_reset = false;
+        qtree.clear();
+        grid.clear();
+        multi_grid.clear();
+        indexed_count = 0;
+        pairs_valid = false;
+    }
+
+    // Sorts the particles along a Morton curve of unit cells, so particles close in space are close in memory.
+    // Ids keep pointing to their particle, every index based structure is rebuilt.
+    void reorder() {
+        ProfileScope scope{profiler, "reorder"};
+        const int count = particles.size();
+        reorder_keys.resize(count);
+        pool.parallelFor(count, [&](int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                const uint32_t cell_x = std::clamp(static_cast<int>(particles.x[i]), 0, 0xffff);
+                const uint32_t cell_y = std::clamp(static_cast<int>(particles.y[i]), 0, 0xffff);
+                reorder_keys[i] = (static_cast<uint64_t>(mortonCode(cell_x, cell_y)) << 32) | static_cast<uint32_t>(i);
+            }
+        });
+        std::sort(reorder_keys.begin(), reorder_keys.end());
 
-        for (int i = 1; i < cell_futures.size(); i += 2) {
-            cell_futures[i] = std::async(std::launch::async, solve_objects, vec_of_vecint[i]);
+        const auto gather = [&](auto& values, auto& scratch) {
+            scratch.resize(count);
+            pool.parallelFor(count, [&](int begin, int end) {
+                for (int i = begin; i < end; i++) {
+                    scratch[i] = values[static_cast<uint32_t>(reorder_keys[i])];
+                }
+            });
+            values.swap(scratch);
+        };
+        gather(particles.x, reorder_floats);
+        gather(particles.y, reorder_floats);
+        gather(particles.last_x, reorder_floats);
+        gather(particles.last_y, reorder_floats);
+        gather(particles.radius, reorder_floats);
+        gather(particles.ids, reorder_ints);
+        gather(particles.rest, reorder_bytes);
+        gather(colors, reorder_colors);
+        pool.parallelFor(count, [&](int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                particles.indices[particles.ids[i]] = i;
+            }
+        });
+
+        resetIndex();
+        reordered_locality = 0.0f;
+        frames_since_reorder = 0;
+    }
+
+    // Calls visit(begin, end) on every run of consecutive blocks of [first_block, last_block) flagged in awake_blocks
+    template <typename Visitor>
+    void forEachAwakeRun(int first_block, int last_block, Visitor&& visit) const {
+        const int count = particles.size();
+        for (int block = first_block; block < last_block;) {
+            if (!awake_blocks[block]) {
+                block++;
+                continue;
+            }
+            const int begin = block * sleep_block_size;
+            while (block < last_block && awake_blocks[block]) {
+                block++;
+            }
+            visit(begin, std::min(count, block * sleep_block_size));
         }
+    }
 
-        for (int i = 1; i < cell_futures.size(); i += 2) {
-            cell_futures[i].wait();
+    // Runs fn(begin, end, worker) in parallel on the particles that may have moved during the last substep, which
+    // leaves out the blocks integration skipped while sleeping is enabled
+    template <typename Fn>
+    void parallelForMoving(Fn&& fn) {
+        if (sleep_steps == 0) {
+            pool.parallelFor(particles.size(), fn);
+            return;
         }
+        pool.parallelFor(awake_blocks.size(), [&](int begin, int end, int worker) {
+            forEachAwakeRun(begin, end, [&](int first, int last) { fn(first, last, worker); });
+        });
     }
 
     void updateObjects(float dt) {
-        for (size_t i = 0; i < objects.size(); i++) {
-            PhysicsObject& obj = objects[i];
-            obj.acceleration += gravity;
-            obj.update(dt);
-            const float margin = 1.0f;
-            if (obj.position.x > world_size.x - margin) {
-                obj.position.x = world_size.x - margin;
-            } else if (obj.position.x < margin) {
-                obj.position.x = margin;
+        worker_sleeping.assign(pool.size(), 0);
+        const auto integrate = [&](int begin, int end, int worker) {
+            {
+                // The wall clamp is fused in the integration kernel
+                ProfileScope scope{profiler, "integrate", worker};
+                integrateAxis(particles.x.data(), particles.last_x.data(), particles.radius.data(), begin, end, gravity.x, dt, wall_margin, world_size.x - wall_margin);
+                integrateAxis(particles.y.data(), particles.last_y.data(), particles.radius.data(), begin, end, gravity.y, dt, wall_margin, world_size.y - wall_margin);
             }
-            if (obj.position.y > world_size.y - margin) {
-                obj.position.y = world_size.y - margin;
-            } else if (obj.position.y < margin) {
-                obj.position.y = margin;
+            if (sleep_steps > 0) {
+                ProfileScope scope{profiler, "sleep", worker};
+                worker_sleeping[worker] += updateSleep(begin, end);
             }
+        };
+        if (sleep_steps == 0) {
+            pool.parallelFor(particles.size(), integrate);
+        } else {
+            // A block only holding sleeping particles that no contact or link moved has nothing to integrate nor pin back
+            const int count = particles.size();
+            pool.parallelFor(awake_blocks.size(), [&](int begin, int end, int worker) {
+                for (int block = begin; block < end; block++) {
+                    const int first = block * sleep_block_size;
+                    const int last = std::min(count, first + sleep_block_size);
+                    int moving = 0;
+                    for (int i = first; i < last; i++) {
+                        moving |= (particles.rest[i] < sleep_steps) | (particles.x[i] != particles.last_x[i]) | (particles.y[i] != particles.last_y[i]);
+                    }
+                    awake_blocks[block] = moving;
+                    if (!moving) {
+                        worker_sleeping[worker] += last - first;
+                    }
+                }
+                forEachAwakeRun(begin, end, [&](int first, int last) { integrate(first, last, worker); });
+            });
+        }
+        sleeping_count = 0;
+        for (const int count : worker_sleeping) {
+            sleeping_count += count;
+        }
+    }
+
+    // The wall gravity pushes a particle against holds it like a contact, the integration clamped it right on that wall
+    bool isOnFloor(int i) const {
+        const float radius = particles.radius[i];
+        return (gravity.y > 0.0f && particles.y[i] >= world_size.y - wall_margin - radius) || (gravity.y < 0.0f && particles.y[i] <= wall_margin + radius) ||
+               (gravity.x > 0.0f && particles.x[i] >= world_size.x - wall_margin - radius) || (gravity.x < 0.0f && particles.x[i] <= wall_margin + radius);
+    }
+
+    // Sleeping particles drop the integration step and only keep the contact corrections they got, without velocity.
+    // Only a supported particle counts as still, a particle slowly starting to fall keeps integrating gravity.
+    // Returns the number of sleeping particles in [begin, end).
+    int updateSleep(int begin, int end) {
+        const float threshold_sq = sleep_threshold * sleep_threshold;
+        int sleeping = 0;
+        for (int i = begin; i < end; i++) {
+            const bool supported = contact_support[i] || isOnFloor(i);
+            contact_support[i] = 0;
+            if (particles.rest[i] >= sleep_steps) {
+                particles.x[i] = particles.last_x[i];
+                particles.y[i] = particles.last_y[i];
+                sleeping++;
+                continue;
+            }
+            const float dx = particles.x[i] - particles.last_x[i];
+            const float dy = particles.y[i] - particles.last_y[i];
+            if (!supported || dx * dx + dy * dy >= threshold_sq) {
+                particles.rest[i] = 0;
+            } else if (++particles.rest[i] == sleep_steps) {
+                particles.last_x[i] = particles.x[i];
+                particles.last_y[i] = particles.y[i];
+                sleeping++;
+            }
+        }
+        return sleeping;
+    }
+
+    // Largest displacement of a particle during the last substep
+    float measureDisplacement() {
+        worker_displacement.assign(pool.size(), 0.0f);
+        pool.parallelFor(particles.size(), [&](int begin, int end, int worker) {
+            float largest = 0.0f;
+            for (int i = begin; i < end; i++) {
+                const float dx = particles.x[i] - particles.last_x[i];
+                const float dy = particles.y[i] - particles.last_y[i];
+                largest = std::max(largest, dx * dx + dy * dy);
+            }
+            worker_displacement[worker] = largest;
+        });
+        return std::sqrt(*std::max_element(worker_displacement.begin(), worker_displacement.end()));
+    }
+
+    // Changes the substep count and rescales the velocities, which Verlet stores as a displacement per substep
+    void setSubSteps(int count) {
+        if (count == sub_steps) {
+            return;
+        }
+        const float scale = static_cast<float>(sub_steps) / static_cast<float>(count);
+        pool.parallelFor(particles.size(), [&](int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                particles.last_x[i] = particles.x[i] - (particles.x[i] - particles.last_x[i]) * scale;
+                particles.last_y[i] = particles.y[i] - (particles.y[i] - particles.last_y[i]) * scale;
+            }
+        });
+        sub_steps = count;
+    }
+
+    // Goes up at once to the count bringing the displacement and the overlap of the last substep under their targets.
+    // Goes down by one substep only once the displacement and overlap predicted with one substep fewer stayed under half
+    // their target for calm_frames_before_step_down updates in a row.
+    // The displacement per substep shrinks linearly with the count, the overlap piling up under gravity quadratically.
+    int chooseSubSteps() {
+        const float frame_displacement = step_displacement * sub_steps;
+        const float needed = std::max(frame_displacement / target_displacement, sub_steps * std::sqrt(step_overlap / target_overlap));
+        int count = sub_steps;
+        if (needed > sub_steps) {
+            count = static_cast<int>(std::ceil(needed));
+            calm_frames = 0;
+        } else if (sub_steps > 1) {
+            const float fewer = static_cast<float>(sub_steps - 1);
+            const float ratio = sub_steps / fewer;
+            const bool calm = frame_displacement / fewer < 0.5f * target_displacement && step_overlap * ratio * ratio < 0.5f * target_overlap;
+            calm_frames = calm ? calm_frames + 1 : 0;
+            if (calm_frames >= calm_frames_before_step_down) {
+                count = sub_steps - 1;
+                calm_frames = 0;
+            }
+        }
+        return std::clamp(count, min_sub_steps, max_sub_steps);
+    }
+
+    // Samples the counters of the frame, the quadtree is only walked while profiling
+    void recordCounters() {
+        profiler.counter("sub_steps", sub_steps);
+        profiler.counter("candidate_pairs", pair_count);
+        profiler.counter("broadphase_candidates", candidate_count);
+        profiler.counter("contacts", collision_count);
+        profiler.counter("links", constraints.link_count);
+        profiler.counter("pair_builds", pair_builds);
+        profiler.counter("index_moved", moved_count);
+        profiler.counter("sleeping", sleeping_count);
+        profiler.counter("deepest_overlap", step_overlap);
+        if (broadphase == Broadphase::QuadTree && profiler.enabled) {
+            const QuadTreeStats stats = qtree.getStats();
+            profiler.counter("tree_nodes", stats.nodes);
+            profiler.counter("tree_depth", stats.depth);
         }
     }
 
     void update(float dt) {
+        profiler.beginFrame();
+        ProfileScope scope{profiler, "update"};
+        if (adaptive_sub_steps) {
+            ProfileScope adapt_scope{profiler, "adapt"};
+            setSubSteps(chooseSubSteps());
+        }
         const float sub_dt = dt / static_cast<float>(sub_steps);
+        if (sleep_steps > 0) {
+            // A particle resting on something still moves by the pull of gravity before the contacts push it back
+            sleep_threshold = sleep_speed * sub_dt + std::sqrt(gravity.x * gravity.x + gravity.y * gravity.y) * sub_dt * sub_dt;
+            contact_support.assign(particles.size(), 0);
+        }
+        collision_count = 0;
+        narrowphase_ns = 0;
+        constraint_count = 0;
+        constraints_ns = 0;
+        moved_count = 0;
+        pair_builds = 0;
+        if (needsReorder()) {
+            reorder();
+        }
+        frames_since_reorder++;
+        if (needs_index_reset) {
+            resetIndex();
+        }
+        if (partition.needs_rebalance || partition.workers != pool.size()) {
+            ProfileScope rebalance_scope{profiler, "rebalance"};
+            partition.rebalance(particles.x.data(), particles.y.data(), particles.size(), pool);
+            pairs_valid = false;
+        }
+        if (sleep_steps > 0) {
+            // Particles may have been moved since the last update, the first substep goes through all of them
+            awake_blocks.assign((particles.size() + sleep_block_size - 1) / sleep_block_size, 1);
+        }
+        int pass = 0;  // Gauss-Seidel passes of this update, odd ones run in reverse order
         for (int i = sub_steps; i--;) {
-            addObjectsToTree();
-            solveCollisions();
+            if (pairsNeedRebuild()) {
+                findPairs();
+            }
+            if (!removed_areas.empty()) {
+                ProfileScope wake_scope{profiler, "wake"};
+                if (broadphase == Broadphase::Grid) {
+                    wakeRemovedSupport(grid);
+                } else if (broadphase == Broadphase::MultiGrid) {
+                    wakeRemovedSupport(multi_grid);
+                } else {
+                    wakeRemovedSupport(qtree);
+                }
+            }
+            if (sleep_steps > 0 && contact_solver == ContactSolver::GaussSeidel) {
+                markAwakeTiles();
+            }
+            step_overlap = 0.0f;
+            for (int iteration = 0; iteration < solver_iterations; iteration++) {
+                const int64_t narrowphase_start = profiler.now();
+                if (contact_solver == ContactSolver::Jacobi) {
+                    solveCollisionsJacobi();
+                } else {
+                    solveCollisions(pass++ & 1);
+                }
+                const int64_t constraints_start = profiler.now();
+                narrowphase_ns += constraints_start - narrowphase_start;
+                if (constraints.link_count > 0) {
+                    solveConstraints();
+                    constraints_ns += profiler.now() - constraints_start;
+                }
+            }
             updateObjects(sub_dt);
         }
+        if (adaptive_sub_steps) {
+            ProfileScope adapt_scope{profiler, "adapt"};
+            step_displacement = measureDisplacement();
+        }
+        recordCounters();
     }
 };
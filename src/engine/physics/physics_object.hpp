@@ -1,5 +1,6 @@
 #pragma once
-#include <SFML/Graphics.hpp>
+#include <SFML/Graphics/Color.hpp>
+#include <algorithm>
 
 #include "engine/common/quadtree.hpp"
 #include "engine/common/vec.hpp"
@@ -7,7 +8,7 @@
 struct PhysicsObject {
     Vec2 position = {0.0f, 0.0f};
     Vec2 last_position = {0.0f, 0.0f};
-    Vec2 acceleration = {0.0f, 0.0f};
+    float radius = 0.5f;
     sf::Color color;
 
     PhysicsObject() = default;
@@ -19,20 +20,13 @@ struct PhysicsObject {
         last_position = pos;
     }
 
-    void update(float dt) {
-        const Vec2 v(2.0f * position - last_position);
-        const Vec2 new_position = v + acceleration * (dt * dt);
-        last_position = position;
-        position = new_position;
-        acceleration = {0.0f, 0.0f};
-    }
-
+    // Points closer than the contact distance of a ball of the same size
     bool contains(const QuadObject& point) const {
         float dx = point.position.x - position.x;
         float dy = point.position.y - position.y;
         float dist_sq = dx * dx + dy * dy;
-        // Radius is always equal to 1
-        return dist_sq < 1.0f;
+        const float range = 2.0f * radius;
+        return dist_sq < range * range;
     }
 
     bool intersects(const QuadCell& rect) const {
@@ -48,7 +42,12 @@ struct PhysicsObject {
         float dy = nearest_y - position.y;
         float dist_sq = dx * dx + dy * dy;
 
-        // Radius is always equal to 1
-        return dist_sq <= 1.0f;
+        const float range = 2.0f * radius;
+        return dist_sq <= range * range;
+    }
+
+    QuadCell getBounds() const {
+        const float range = 2.0f * radius;
+        return QuadCell{position, 2.0f * range, 2.0f * range};
     }
 };
@@ -0,0 +1,138 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "engine/common/triple_buffer.hpp"
+#include "physics.hpp"
+
+// Positions of one physics tick in id order, so they stay comparable across reorders of the particle arrays.
+// Ids of removed balls are transparent.
+struct PhysicsSnapshot {
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> previous_x;  // positions at the previous tick, equal to the current ones for new balls
+    std::vector<float> previous_y;
+    std::vector<float> radius;
+    std::vector<sf::Color> colors;
+    int layout_version = 0;  // solver layout version, changes when ids may have been given to other balls
+    int sub_steps = 0;
+    int64_t tick = -1;
+    std::chrono::steady_clock::time_point time;  // when the tick was published
+    std::chrono::nanoseconds update_time{0};    // time spent in PhysicsSolver::update
+};
+
+// Runs the solver on its own thread at a fixed tick rate and publishes a snapshot after every tick.
+// The solver belongs to the physics thread while it runs, other threads only read the published snapshots.
+struct PhysicsThread {
+    PhysicsSolver& solver;
+    float tick_dt;
+    std::function<void(PhysicsSolver&)> before_tick;  // called on the physics thread before every update, e.g. to add balls
+    TripleBuffer<PhysicsSnapshot> snapshots;
+    std::vector<float> last_x;  // positions published by the last tick, in id order
+    std::vector<float> last_y;
+    std::vector<uint32_t> last_generations;  // generation of each id at the last tick, an id given to a new ball isn't interpolated
+    std::atomic<bool> running{false};
+    std::thread thread;
+
+    PhysicsThread(PhysicsSolver& _solver, float _tick_dt, std::function<void(PhysicsSolver&)> _before_tick = {})
+        : solver{_solver}, tick_dt{_tick_dt}, before_tick{std::move(_before_tick)} {}
+
+    ~PhysicsThread() {
+        stop();
+    }
+
+    PhysicsThread(const PhysicsThread&) = delete;
+    PhysicsThread& operator=(const PhysicsThread&) = delete;
+
+    void start() {
+        if (running.exchange(true)) {
+            return;
+        }
+        thread = std::thread{[this] { run(); }};
+    }
+
+    void stop() {
+        running = false;
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    // Fraction of a tick elapsed since the snapshot was published, to interpolate between its two positions
+    float getInterpolation(const PhysicsSnapshot& snapshot, std::chrono::steady_clock::time_point now) const {
+        const float elapsed = std::chrono::duration<float>(now - snapshot.time).count();
+        return std::clamp(elapsed / tick_dt, 0.0f, 1.0f);
+    }
+
+  private:
+    void run() {
+        using clock = std::chrono::steady_clock;
+        const auto tick_duration = std::chrono::duration_cast<clock::duration>(std::chrono::duration<float>(tick_dt));
+        auto next_tick = clock::now();
+        for (int64_t tick = 0; running.load(std::memory_order_relaxed); tick++) {
+            if (before_tick) {
+                before_tick(solver);
+            }
+            const auto update_start = clock::now();
+            solver.update(tick_dt);
+            const auto update_time = clock::now() - update_start;
+            publish(tick, update_time);
+
+            // A late tick starts the next one at once instead of trying to catch up
+            next_tick += tick_duration;
+            const auto now = clock::now();
+            if (next_tick > now) {
+                std::this_thread::sleep_until(next_tick);
+            } else {
+                next_tick = now;
+            }
+        }
+    }
+
+    void publish(int64_t tick, std::chrono::steady_clock::duration update_time) {
+        const Particles& particles = solver.particles;
+        const int count = particles.getIdCount();
+        const int known = last_x.size();
+        PhysicsSnapshot& snapshot = snapshots.getWriteBuffer();
+        snapshot.x.resize(count);
+        snapshot.y.resize(count);
+        snapshot.previous_x.resize(count);
+        snapshot.previous_y.resize(count);
+        snapshot.radius.resize(count);
+        snapshot.colors.resize(count);
+        last_x.resize(count);
+        last_y.resize(count);
+        last_generations.resize(count);
+        solver.pool.parallelFor(count, [&](int begin, int end) {
+            for (int id = begin; id < end; id++) {
+                const int i = particles.indices[id];
+                if (i == -1) {
+                    snapshot.x[id] = snapshot.y[id] = snapshot.previous_x[id] = snapshot.previous_y[id] = snapshot.radius[id] = 0.0f;
+                    snapshot.colors[id] = sf::Color::Transparent;
+                    continue;
+                }
+                snapshot.x[id] = particles.x[i];
+                snapshot.y[id] = particles.y[i];
+                snapshot.radius[id] = particles.radius[i];
+                snapshot.colors[id] = solver.colors[i];
+                const bool same_ball = id < known && last_generations[id] == particles.generations[id];
+                snapshot.previous_x[id] = same_ball ? last_x[id] : particles.x[i];
+                snapshot.previous_y[id] = same_ball ? last_y[id] : particles.y[i];
+                last_x[id] = particles.x[i];
+                last_y[id] = particles.y[i];
+                last_generations[id] = particles.generations[id];
+            }
+        });
+
+        snapshot.layout_version = solver.layout_version;
+        snapshot.sub_steps = solver.sub_steps;
+        snapshot.tick = tick;
+        snapshot.update_time = std::chrono::duration_cast<std::chrono::nanoseconds>(update_time);
+        snapshot.time = std::chrono::steady_clock::now();
+        snapshots.publish();
+    }
+};
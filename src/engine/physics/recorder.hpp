@@ -0,0 +1,387 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "engine/common/vec.hpp"
+#include "physics.hpp"
+
+// Trajectory file: a header, one chunk per frame, then an index of the chunk offsets and a footer.
+// Positions are stored in id order, quantized to 16 bits per axis over the world size. A frame stores every value
+// as the difference to the previous frame, key frames as the difference to 0 so playback can start from them.
+// Differences are zigzag varints, and a run of zero differences is stored as a single varint, so resting balls cost
+// nearly nothing. The x values of a frame come first, then the y values.
+struct TrajectoryHeader {
+    char magic[4];
+    uint32_t version;
+    float world_width;
+    float world_height;
+    uint32_t keyframe_interval;
+};
+
+struct TrajectoryChunk {
+    uint32_t bytes;  // size of the encoded values following the chunk header
+    uint32_t count;  // balls in the frame
+    uint32_t key;    // 1 when the values are not relative to the previous frame
+};
+
+struct TrajectoryFooter {
+    uint64_t index_offset;  // offset of the frame count followed by one uint64 offset per chunk
+    char magic[4];
+};
+
+constexpr char trajectory_magic[4] = {'V', 'B', 'T', 'R'};
+constexpr char trajectory_index_magic[4] = {'V', 'B', 'T', 'I'};
+constexpr uint32_t trajectory_version = 1;
+
+inline uint16_t quantizePosition(float value, float size) {
+    return static_cast<uint16_t>(std::clamp(value / size, 0.0f, 1.0f) * 65535.0f + 0.5f);
+}
+
+inline float dequantizePosition(uint16_t value, float size) {
+    return value * (size / 65535.0f);
+}
+
+inline void writeVarint(std::vector<uint8_t>& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(value) | 0x80);
+        value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+inline uint64_t readVarint(const uint8_t*& in, const uint8_t* end) {
+    uint64_t value = 0;
+    for (int shift = 0; in < end && shift < 64; shift += 7) {
+        const uint8_t byte = *in++;
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            break;
+        }
+    }
+    return value;
+}
+
+// Appends the differences of current to previous, missing previous values count as 0.
+// Tokens are (zigzag(difference) << 1) for a difference, (run << 1) | 1 for a run of zero differences.
+inline void encodeAxis(std::vector<uint8_t>& out, const std::vector<uint16_t>& current, const std::vector<uint16_t>& previous, bool key) {
+    uint64_t zeros = 0;
+    for (size_t i = 0; i < current.size(); i++) {
+        const int32_t difference = static_cast<int32_t>(current[i]) - (key || i >= previous.size() ? 0 : previous[i]);
+        if (difference == 0) {
+            zeros++;
+            continue;
+        }
+        if (zeros > 0) {
+            writeVarint(out, (zeros << 1) | 1);
+            zeros = 0;
+        }
+        const uint32_t zigzag = (static_cast<uint32_t>(difference) << 1) ^ static_cast<uint32_t>(difference >> 31);
+        writeVarint(out, static_cast<uint64_t>(zigzag) << 1);
+    }
+    if (zeros > 0) {
+        writeVarint(out, (zeros << 1) | 1);
+    }
+}
+
+// Applies the differences of an encoded axis to values, which holds the previous frame (or zeros for a key frame)
+inline const uint8_t* decodeAxis(const uint8_t* in, const uint8_t* end, std::vector<uint16_t>& values) {
+    size_t i = 0;
+    while (i < values.size() && in < end) {
+        const uint64_t token = readVarint(in, end);
+        if (token & 1) {
+            i = std::min(values.size(), i + static_cast<size_t>(token >> 1));
+        } else {
+            const uint32_t zigzag = static_cast<uint32_t>(token >> 1);
+            const int32_t difference = static_cast<int32_t>(zigzag >> 1) ^ -static_cast<int32_t>(zigzag & 1);
+            values[i] = static_cast<uint16_t>(values[i] + difference);
+            i++;
+        }
+    }
+    return in;
+}
+
+// Streams the positions of every frame to a trajectory file. record() only quantizes the positions on the calling
+// thread, encoding and writing happen on a background thread so the solver only waits for the disk once max_pending
+// frames are queued.
+struct TrajectoryRecorder {
+    struct Frame {
+        std::vector<uint16_t> x;
+        std::vector<uint16_t> y;
+    };
+
+    std::vector<char> file_buffer;  // declared before the file, which writes into it until it's closed
+    std::ofstream file;
+    Vec2 world_size;
+    int keyframe_interval;
+    std::thread writer;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::condition_variable drained;  // notified whenever the writer takes a frame from pending
+    std::deque<Frame> pending;  // frames waiting for the writer, oldest first
+    std::vector<Frame> free_frames;  // buffers given back by the writer for the next frames
+    size_t max_pending = 64;    // queued frames past which record() waits for the writer, bounding the memory of a slow disk
+    size_t stalled_frames = 0;  // record() calls that had to wait for the writer
+    bool stopping = false;
+    std::atomic<uint64_t> offset{0};  // bytes written, only advanced by the writer thread
+    // Only used by the writer thread
+    Frame previous;
+    std::vector<uint8_t> encoded;
+    std::vector<uint64_t> chunk_offsets;
+
+    // A key frame every keyframe_interval frames bounds the frames decoded to seek
+    TrajectoryRecorder(const std::string& path, const Vec2& size, int _keyframe_interval = 300) : world_size{size}, keyframe_interval{std::max(1, _keyframe_interval)} {
+        file_buffer.resize(1 << 20);
+        file.rdbuf()->pubsetbuf(file_buffer.data(), file_buffer.size());
+        file.open(path, std::ios::binary | std::ios::trunc);
+        if (!file) {
+            return;
+        }
+        TrajectoryHeader header{};
+        std::memcpy(header.magic, trajectory_magic, sizeof(header.magic));
+        header.version = trajectory_version;
+        header.world_width = world_size.x;
+        header.world_height = world_size.y;
+        header.keyframe_interval = keyframe_interval;
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        offset.store(sizeof(header), std::memory_order_relaxed);
+        writer = std::thread{[this] { writerLoop(); }};
+    }
+
+    ~TrajectoryRecorder() {
+        close();
+    }
+
+    TrajectoryRecorder(const TrajectoryRecorder&) = delete;
+    TrajectoryRecorder& operator=(const TrajectoryRecorder&) = delete;
+
+    bool isOpen() const {
+        return writer.joinable();
+    }
+
+    // Quantizes the current positions in id order with the solver's workers and queues them for the writer
+    void record(PhysicsSolver& solver) {
+        if (!isOpen()) {
+            return;
+        }
+        Frame frame;
+        {
+            std::lock_guard lock{mutex};
+            if (!free_frames.empty()) {
+                frame = std::move(free_frames.back());
+                free_frames.pop_back();
+            }
+        }
+        const Particles& particles = solver.particles;
+        const int count = particles.getIdCount();
+        frame.x.resize(count);
+        frame.y.resize(count);
+        solver.pool.parallelFor(count, [&](int begin, int end) {
+            for (int id = begin; id < end; id++) {
+                const int i = particles.indices[id];
+                // Ids of removed balls are kept at the origin
+                frame.x[id] = i == -1 ? 0 : quantizePosition(particles.x[i], world_size.x);
+                frame.y[id] = i == -1 ? 0 : quantizePosition(particles.y[i], world_size.y);
+            }
+        });
+        {
+            std::unique_lock lock{mutex};
+            if (pending.size() >= max_pending) {
+                stalled_frames++;
+                drained.wait(lock, [this] { return pending.size() < max_pending; });
+            }
+            pending.push_back(std::move(frame));
+        }
+        condition.notify_one();
+    }
+
+    // Writes the frames still queued, then the index, the recorder can't be used afterwards
+    void close() {
+        if (!isOpen()) {
+            return;
+        }
+        {
+            std::lock_guard lock{mutex};
+            stopping = true;
+        }
+        condition.notify_one();
+        writer.join();
+
+        const uint64_t index_offset = offset.load(std::memory_order_relaxed);
+        const uint64_t frames = chunk_offsets.size();
+        file.write(reinterpret_cast<const char*>(&frames), sizeof(frames));
+        file.write(reinterpret_cast<const char*>(chunk_offsets.data()), chunk_offsets.size() * sizeof(uint64_t));
+        TrajectoryFooter footer{};
+        footer.index_offset = index_offset;
+        std::memcpy(footer.magic, trajectory_index_magic, sizeof(footer.magic));
+        file.write(reinterpret_cast<const char*>(&footer), sizeof(footer));
+        file.close();
+        offset.store(index_offset + sizeof(frames) + chunk_offsets.size() * sizeof(uint64_t) + sizeof(footer), std::memory_order_relaxed);
+    }
+
+    // Bytes of the frames written so far from any thread, the whole file size once the recorder is closed
+    uint64_t getBytesWritten() const {
+        return offset.load(std::memory_order_relaxed);
+    }
+
+  private:
+    void writerLoop() {
+        std::unique_lock lock{mutex};
+        while (true) {
+            condition.wait(lock, [this] { return stopping || !pending.empty(); });
+            if (pending.empty()) {
+                return;
+            }
+            Frame frame = std::move(pending.front());
+            pending.pop_front();
+            lock.unlock();
+            drained.notify_one();
+
+            writeFrame(frame);
+            std::swap(frame, previous);
+
+            lock.lock();
+            free_frames.push_back(std::move(frame));
+        }
+    }
+
+    void writeFrame(const Frame& frame) {
+        const bool key = chunk_offsets.size() % keyframe_interval == 0;
+        encoded.clear();
+        encodeAxis(encoded, frame.x, previous.x, key);
+        encodeAxis(encoded, frame.y, previous.y, key);
+
+        const TrajectoryChunk chunk{static_cast<uint32_t>(encoded.size()), static_cast<uint32_t>(frame.x.size()), key ? 1u : 0u};
+        const uint64_t chunk_offset = offset.load(std::memory_order_relaxed);
+        chunk_offsets.push_back(chunk_offset);
+        file.write(reinterpret_cast<const char*>(&chunk), sizeof(chunk));
+        file.write(reinterpret_cast<const char*>(encoded.data()), encoded.size());
+        offset.store(chunk_offset + sizeof(chunk) + encoded.size(), std::memory_order_relaxed);
+    }
+};
+
+// Reads a trajectory file frame by frame or at any frame, seeking goes through the closest key frame before it
+struct TrajectoryReader {
+    std::ifstream file;
+    Vec2 world_size;
+    int keyframe_interval = 1;
+    std::vector<uint64_t> chunk_offsets;
+    std::vector<uint16_t> x;  // quantized positions of the last decoded frame
+    std::vector<uint16_t> y;
+    int current = -1;         // last decoded frame
+    std::vector<uint8_t> encoded;
+
+    // A file without index, from a recorder that wasn't closed, is indexed by walking its chunks
+    explicit TrajectoryReader(const std::string& path) : file{path, std::ios::binary} {
+        TrajectoryHeader header;
+        if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) || std::memcmp(header.magic, trajectory_magic, sizeof(header.magic)) != 0 ||
+            header.version != trajectory_version) {
+            file.close();
+            return;
+        }
+        world_size = {header.world_width, header.world_height};
+        keyframe_interval = std::max(1u, header.keyframe_interval);
+        if (!readIndex()) {
+            scanChunks(sizeof(header));
+        }
+    }
+
+    bool isOpen() const {
+        return file.is_open();
+    }
+
+    int getFrameCount() const {
+        return chunk_offsets.size();
+    }
+
+    // Fills positions with the positions of frame n in id order, returns false when the frame can't be read
+    bool readFrame(int n, std::vector<Vec2>& positions) {
+        if (!isOpen() || n < 0 || n >= getFrameCount()) {
+            return false;
+        }
+        // Continues from the last decoded frame when it's between the key frame and n
+        const int key = n - n % keyframe_interval;
+        const int start = current >= key && current <= n ? current + 1 : key;
+        for (int frame = start; frame <= n; frame++) {
+            if (!decodeFrame(frame)) {
+                current = -1;
+                return false;
+            }
+        }
+
+        positions.resize(x.size());
+        for (size_t i = 0; i < x.size(); i++) {
+            positions[i] = {dequantizePosition(x[i], world_size.x), dequantizePosition(y[i], world_size.y)};
+        }
+        return true;
+    }
+
+  private:
+    bool readIndex() {
+        TrajectoryFooter footer;
+        file.seekg(0, std::ios::end);
+        const uint64_t size = file.tellg();
+        if (size < sizeof(TrajectoryHeader) + sizeof(footer)) {
+            file.clear();
+            return false;
+        }
+        file.seekg(size - sizeof(footer));
+        uint64_t frames = 0;
+        if (!file.read(reinterpret_cast<char*>(&footer), sizeof(footer)) || std::memcmp(footer.magic, trajectory_index_magic, sizeof(footer.magic)) != 0 ||
+            footer.index_offset >= size || !file.seekg(footer.index_offset) || !file.read(reinterpret_cast<char*>(&frames), sizeof(frames)) ||
+            footer.index_offset + sizeof(frames) + frames * sizeof(uint64_t) + sizeof(footer) != size) {
+            file.clear();
+            return false;
+        }
+        chunk_offsets.resize(frames);
+        return static_cast<bool>(file.read(reinterpret_cast<char*>(chunk_offsets.data()), frames * sizeof(uint64_t)));
+    }
+
+    void scanChunks(uint64_t offset) {
+        chunk_offsets.clear();
+        file.clear();
+        file.seekg(0, std::ios::end);
+        const uint64_t size = file.tellg();
+        TrajectoryChunk chunk;
+        // The last chunk may have been cut short
+        while (offset + sizeof(chunk) <= size && file.seekg(offset) && file.read(reinterpret_cast<char*>(&chunk), sizeof(chunk)) && offset + sizeof(chunk) + chunk.bytes <= size) {
+            chunk_offsets.push_back(offset);
+            offset += sizeof(chunk) + chunk.bytes;
+        }
+        file.clear();
+    }
+
+    bool decodeFrame(int frame) {
+        TrajectoryChunk chunk;
+        file.clear();
+        if (!file.seekg(chunk_offsets[frame]) || !file.read(reinterpret_cast<char*>(&chunk), sizeof(chunk))) {
+            return false;
+        }
+        encoded.resize(chunk.bytes);
+        if (!file.read(reinterpret_cast<char*>(encoded.data()), encoded.size())) {
+            return false;
+        }
+        if (chunk.key) {
+            x.assign(chunk.count, 0);
+            y.assign(chunk.count, 0);
+        } else {
+            // New balls start from 0 like in the recorder
+            x.resize(chunk.count, 0);
+            y.resize(chunk.count, 0);
+        }
+        const uint8_t* in = encoded.data();
+        const uint8_t* end = in + encoded.size();
+        in = decodeAxis(in, end, x);
+        decodeAxis(in, end, y);
+        current = frame;
+        return true;
+    }
+};
@@ -0,0 +1,358 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "physics.hpp"
+
+// Binary snapshot of a solver: a fixed header followed by one array per particle attribute, then the distance links and
+// the state of the pair lists, each array starting on a 64 bytes boundary so the arrays of a mapped file can be read in
+// place. Values are stored in native byte order.
+struct SnapshotHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t count;      // particles
+    int32_t sub_steps;
+    float world_width;
+    float world_height;
+    float gravity_x;
+    float gravity_y;
+    uint64_t file_size;  // guards against truncated files
+    uint32_t links;      // distance links, only in version 3 and later, older versions leave zero padding here
+    uint32_t tile_columns;  // tiles of the saved pair lists, 0 when they weren't saved, only in version 4 and later
+    uint32_t tile_rows;
+};
+
+// A distance link between two saved ids, in the color it was solved in so the solve order is kept
+struct SnapshotLink {
+    int32_t a;
+    int32_t b;
+    float rest_length;
+    float stiffness;
+    float break_strain;
+    uint32_t color;
+};
+
+constexpr char snapshot_magic[4] = {'V', 'B', 'S', 'N'};
+constexpr uint32_t snapshot_version = 4;  // version 1 had no radius array, its balls all have the default radius, version 2 had no links, version 3 no pair lists
+
+// Offsets of the arrays of a snapshot holding count particles, in file order
+struct SnapshotLayout {
+    size_t x;
+    size_t y;
+    size_t last_x;
+    size_t last_y;
+    size_t ids;     // id of the particle stored at each index, so ids stay valid across a save and a load
+    size_t colors;  // RGBA, one uint32 per particle
+    size_t rest;
+    size_t radius;  // only in version 2 and later
+    size_t links;   // SnapshotLink array, only in version 3 and later
+    size_t pair_x;  // positions the pair lists were built at, only in version 4 and later when tile_columns isn't 0
+    size_t pair_y;
+    size_t column_bounds;  // int32 tile bounds, tile_columns + 1 of them
+    size_t row_bounds;     // tile_columns * (tile_rows + 1) of them
+    size_t end;
+
+    explicit SnapshotLayout(uint32_t count, uint32_t version = snapshot_version, uint32_t link_count = 0, uint32_t tile_columns = 0, uint32_t tile_rows = 0) {
+        const auto next = [](size_t offset, size_t bytes) { return (offset + bytes + 63) & ~size_t{63}; };
+        x = next(0, sizeof(SnapshotHeader));
+        y = next(x, count * sizeof(float));
+        last_x = next(y, count * sizeof(float));
+        last_y = next(last_x, count * sizeof(float));
+        ids = next(last_y, count * sizeof(float));
+        colors = next(ids, count * sizeof(int32_t));
+        rest = next(colors, count * sizeof(uint32_t));
+        links = 0;
+        pair_x = pair_y = column_bounds = row_bounds = 0;
+        if (version >= 4 && tile_columns > 0) {
+            radius = next(rest, count);
+            links = next(radius, count * sizeof(float));
+            pair_x = next(links, link_count * sizeof(SnapshotLink));
+            pair_y = next(pair_x, count * sizeof(float));
+            column_bounds = next(pair_y, count * sizeof(float));
+            row_bounds = next(column_bounds, (size_t{tile_columns} + 1) * sizeof(int32_t));
+            end = row_bounds + size_t{tile_columns} * (size_t{tile_rows} + 1) * sizeof(int32_t);
+        } else if (version >= 3) {
+            radius = next(rest, count);
+            links = next(radius, count * sizeof(float));
+            end = links + link_count * sizeof(SnapshotLink);
+        } else if (version == 2) {
+            radius = next(rest, count);
+            end = radius + count * sizeof(float);
+        } else {
+            radius = 0;
+            end = rest + count;
+        }
+    }
+};
+
+// Returns false when the file can't be written
+inline bool saveSnapshot(const PhysicsSolver& solver, const std::string& path) {
+    const Particles& particles = solver.particles;
+    const uint32_t count = particles.size();
+    // Ids of removed particles leave holes, live ids are renumbered from 0 keeping their order
+    std::vector<int32_t> dense_ids(particles.getIdCount(), -1);
+    int32_t next_id = 0;
+    for (int id = 0; id < particles.getIdCount(); id++) {
+        if (particles.indices[id] != -1) {
+            dense_ids[id] = next_id++;
+        }
+    }
+    // Links to a removed particle would be dropped by the next solve anyway
+    std::vector<SnapshotLink> links;
+    for (size_t color = 0; color < solver.constraints.color_links.size(); color++) {
+        for (const DistanceLink& link : solver.constraints.color_links[color]) {
+            if (particles.isAlive(link.a) && particles.isAlive(link.b)) {
+                links.push_back({dense_ids[link.a.id], dense_ids[link.b.id], link.rest_length, link.stiffness, link.break_strain, static_cast<uint32_t>(color)});
+            }
+        }
+    }
+    // The pair lists are only worth saving while the next update keeps them, a rebalance would rebuild them anyway
+    const TilePartition& partition = solver.partition;
+    const bool save_pairs = solver.pairs_valid && !partition.needs_rebalance && solver.pair_x.size() == count;
+    const uint32_t tile_columns = save_pairs ? partition.columns : 0;
+    const uint32_t tile_rows = save_pairs ? partition.rows : 0;
+    const SnapshotLayout layout{count, snapshot_version, static_cast<uint32_t>(links.size()), tile_columns, tile_rows};
+
+    SnapshotHeader header{};
+    std::memcpy(header.magic, snapshot_magic, sizeof(header.magic));
+    header.version = snapshot_version;
+    header.count = count;
+    header.sub_steps = solver.sub_steps;
+    header.world_width = solver.world_size.x;
+    header.world_height = solver.world_size.y;
+    header.gravity_x = solver.gravity.x;
+    header.gravity_y = solver.gravity.y;
+    header.file_size = layout.end;
+    header.links = links.size();
+    header.tile_columns = tile_columns;
+    header.tile_rows = tile_rows;
+
+    std::vector<uint32_t> colors(count);
+    for (uint32_t i = 0; i < count; i++) {
+        colors[i] = solver.colors[i].toInteger();
+    }
+    std::vector<int32_t> ids(count);
+    for (uint32_t i = 0; i < count; i++) {
+        ids[i] = dense_ids[particles.ids[i]];
+    }
+
+    std::ofstream file{path, std::ios::binary | std::ios::trunc};
+    size_t written = 0;
+    const auto write = [&](size_t offset, const void* data, size_t bytes) {
+        static constexpr char padding[64] = {};
+        file.write(padding, offset - written);
+        file.write(static_cast<const char*>(data), bytes);
+        written = offset + bytes;
+    };
+    write(0, &header, sizeof(header));
+    write(layout.x, particles.x.data(), count * sizeof(float));
+    write(layout.y, particles.y.data(), count * sizeof(float));
+    write(layout.last_x, particles.last_x.data(), count * sizeof(float));
+    write(layout.last_y, particles.last_y.data(), count * sizeof(float));
+    write(layout.ids, ids.data(), count * sizeof(int32_t));
+    write(layout.colors, colors.data(), count * sizeof(uint32_t));
+    write(layout.rest, particles.rest.data(), count);
+    write(layout.radius, particles.radius.data(), count * sizeof(float));
+    write(layout.links, links.data(), links.size() * sizeof(SnapshotLink));
+    if (save_pairs) {
+        write(layout.pair_x, solver.pair_x.data(), count * sizeof(float));
+        write(layout.pair_y, solver.pair_y.data(), count * sizeof(float));
+        write(layout.column_bounds, partition.column_bounds.data(), partition.column_bounds.size() * sizeof(int32_t));
+        write(layout.row_bounds, partition.row_bounds.data(), partition.row_bounds.size() * sizeof(int32_t));
+    }
+    return static_cast<bool>(file.flush());
+}
+
+// Read only view of a whole snapshot file, mapped in memory where the platform allows it
+struct SnapshotFile {
+    const char* data = nullptr;
+    size_t size = 0;
+    std::vector<char> buffer;  // file content when it couldn't be mapped
+#if defined(__unix__) || defined(__APPLE__)
+    void* mapping = MAP_FAILED;
+#endif
+
+    explicit SnapshotFile(const std::string& path) {
+#if defined(__unix__) || defined(__APPLE__)
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd == -1) {
+            return;
+        }
+        struct stat info;
+        if (::fstat(fd, &info) == 0 && info.st_size > 0) {
+            mapping = ::mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping != MAP_FAILED) {
+                ::madvise(mapping, info.st_size, MADV_SEQUENTIAL);
+                data = static_cast<const char*>(mapping);
+                size = info.st_size;
+            }
+        }
+        ::close(fd);
+        if (data) {
+            return;
+        }
+#endif
+        std::ifstream file{path, std::ios::binary | std::ios::ate};
+        if (!file) {
+            return;
+        }
+        buffer.resize(file.tellg());
+        file.seekg(0);
+        if (file.read(buffer.data(), buffer.size())) {
+            data = buffer.data();
+            size = buffer.size();
+        }
+    }
+
+    ~SnapshotFile() {
+#if defined(__unix__) || defined(__APPLE__)
+        if (mapping != MAP_FAILED) {
+            ::munmap(mapping, size);
+        }
+#endif
+    }
+
+    SnapshotFile(const SnapshotFile&) = delete;
+    SnapshotFile& operator=(const SnapshotFile&) = delete;
+
+    // The header when the file is a complete snapshot of a supported version
+    std::optional<SnapshotHeader> getHeader() const {
+        SnapshotHeader header;
+        if (size < sizeof(header)) {
+            return std::nullopt;
+        }
+        std::memcpy(&header, data, sizeof(header));
+        if (std::memcmp(header.magic, snapshot_magic, sizeof(header.magic)) != 0 || header.version < 1 || header.version > snapshot_version) {
+            return std::nullopt;
+        }
+        if (header.version < 3) {
+            header.links = 0;
+        }
+        if (header.version < 4) {
+            header.tile_columns = 0;
+            header.tile_rows = 0;
+        }
+        if (header.file_size != SnapshotLayout{header.count, header.version, header.links, header.tile_columns, header.tile_rows}.end || header.file_size > size) {
+            return std::nullopt;
+        }
+        return header;
+    }
+
+    template <typename T>
+    const T* getArray(size_t offset) const {
+        return reinterpret_cast<const T*>(data + offset);
+    }
+};
+
+// Lets the caller build a solver of the right world size before loading
+inline std::optional<SnapshotHeader> readSnapshotHeader(const std::string& path) {
+    return SnapshotFile{path}.getHeader();
+}
+
+// Replaces the particles, links, gravity and substep count of the solver with the ones of the snapshot.
+// The arrays are copied straight out of the mapping. Returns false and leaves the solver untouched when the file
+// is not a valid snapshot or was saved with another world size.
+inline bool loadSnapshot(PhysicsSolver& solver, const std::string& path) {
+    const SnapshotFile file{path};
+    const std::optional<SnapshotHeader> header = file.getHeader();
+    if (!header || header->world_width != solver.world_size.x || header->world_height != solver.world_size.y) {
+        return false;
+    }
+    const uint32_t count = header->count;
+    const SnapshotLayout layout{count, header->version, header->links, header->tile_columns, header->tile_rows};
+    // Ids must be a permutation of the indices
+    const int32_t* ids = file.getArray<int32_t>(layout.ids);
+    std::vector<int> indices(count, -1);
+    for (uint32_t i = 0; i < count; i++) {
+        if (ids[i] < 0 || static_cast<uint32_t>(ids[i]) >= count || indices[ids[i]] != -1) {
+            return false;
+        }
+        indices[ids[i]] = i;
+    }
+    // Links must join two distinct ids, in a color neither of them uses twice
+    const SnapshotLink* links = file.getArray<SnapshotLink>(layout.links);
+    std::vector<uint64_t> link_colors(header->links > 0 ? count : 0, 0);
+    for (uint32_t k = 0; k < header->links; k++) {
+        const SnapshotLink& link = links[k];
+        if (link.a < 0 || static_cast<uint32_t>(link.a) >= count || link.b < 0 || static_cast<uint32_t>(link.b) >= count || link.a == link.b || link.color >= 64) {
+            return false;
+        }
+        const uint64_t bit = uint64_t{1} << link.color;
+        if ((link_colors[link.a] | link_colors[link.b]) & bit) {
+            return false;
+        }
+        link_colors[link.a] |= bit;
+        link_colors[link.b] |= bit;
+    }
+    // Tile bounds must split the world of this solver
+    std::vector<int> column_bounds;
+    std::vector<int> row_bounds;
+    if (header->tile_columns > 0) {
+        const int32_t* columns = file.getArray<int32_t>(layout.column_bounds);
+        const int32_t* rows = file.getArray<int32_t>(layout.row_bounds);
+        column_bounds.assign(columns, columns + size_t{header->tile_columns} + 1);
+        row_bounds.assign(rows, rows + size_t{header->tile_columns} * (size_t{header->tile_rows} + 1));
+        if (!solver.partition.validBounds(header->tile_columns, header->tile_rows, column_bounds, row_bounds)) {
+            return false;
+        }
+    }
+
+    Particles& particles = solver.particles;
+    particles.x.assign(file.getArray<float>(layout.x), file.getArray<float>(layout.x) + count);
+    particles.y.assign(file.getArray<float>(layout.y), file.getArray<float>(layout.y) + count);
+    particles.last_x.assign(file.getArray<float>(layout.last_x), file.getArray<float>(layout.last_x) + count);
+    particles.last_y.assign(file.getArray<float>(layout.last_y), file.getArray<float>(layout.last_y) + count);
+    particles.ids.assign(ids, ids + count);
+    particles.rest.assign(file.getArray<uint8_t>(layout.rest), file.getArray<uint8_t>(layout.rest) + count);
+    if (header->version >= 2) {
+        particles.radius.assign(file.getArray<float>(layout.radius), file.getArray<float>(layout.radius) + count);
+    } else {
+        particles.radius.assign(count, 0.5f);
+    }
+    particles.indices.swap(indices);
+    particles.resetIds();
+    solver.constraints.clear();
+    for (uint32_t k = 0; k < header->links; k++) {
+        const SnapshotLink& link = links[k];
+        solver.constraints.insert({{link.a, 0}, {link.b, 0}, link.rest_length, link.stiffness, link.break_strain}, link.color);
+    }
+    const uint32_t* colors = file.getArray<uint32_t>(layout.colors);
+    solver.colors.resize(count);
+    for (uint32_t i = 0; i < count; i++) {
+        solver.colors[i] = sf::Color{colors[i]};
+    }
+
+    solver.max_radius = 0.5f;
+    for (const float radius : particles.radius) {
+        solver.growRadius(radius);
+    }
+    solver.gravity = {header->gravity_x, header->gravity_y};
+    solver.sub_steps = std::max(1, header->sub_steps);
+    solver.removed_areas.clear();
+    solver.resetIndex();
+    solver.partition.needs_rebalance = true;
+    if (header->tile_columns > 0) {
+        TilePartition& partition = solver.partition;
+        partition.columns = header->tile_columns;
+        partition.rows = header->tile_rows;
+        partition.column_bounds.swap(column_bounds);
+        partition.row_bounds.swap(row_bounds);
+        partition.workers = solver.pool.size();
+        partition.applyBounds();
+        solver.restorePairs({file.getArray<float>(layout.pair_x), file.getArray<float>(layout.pair_x) + count},
+                            {file.getArray<float>(layout.pair_y), file.getArray<float>(layout.pair_y) + count});
+    }
+    return true;
+}
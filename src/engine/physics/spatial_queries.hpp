@@ -0,0 +1,201 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include "engine/common/grid.hpp"
+#include "engine/common/quadtree.hpp"
+#include "engine/common/thread_pool.hpp"
+#include "particles.hpp"
+#include "physics_thread.hpp"
+
+// The count balls nearest to position, closer than max_distance
+struct NearestQuery {
+    Vec2 position;
+    int count;
+    float max_distance = std::numeric_limits<float>::infinity();
+};
+
+// Results of a batch of queries, the balls found by query q are ids[offsets[q], offsets[q + 1]). They are sorted by id,
+// or from the nearest for nearest queries, whose distances are stored at the same place in distances.
+struct QueryResults {
+    std::vector<int> offsets;
+    std::vector<int> ids;
+    std::vector<float> distances;
+
+    std::span<const int> get(int query) const {
+        return {ids.data() + offsets[query], ids.data() + offsets[query + 1]};
+    }
+};
+
+// Answers batches of spatial queries from its own copy of the ball centers, indexed in its own grid and searched by its
+// own pool. Once update() returned the solver is free to run its next step, even while a batch runs.
+// Distances are measured between centers. Batches on the same object must not overlap, nor run during update().
+struct SpatialQueries {
+    static constexpr int chunk_size = 64;  // queries handed to a worker at once
+
+    ThreadPool pool;
+    UniformGrid grid;
+    std::vector<float> x;  // centers copied by the last update, indexed by the ids of the grid objects
+    std::vector<float> y;
+    std::vector<int> ids;  // ball id of every copied center
+    std::vector<std::vector<int>> chunk_ids;  // results of every chunk of queries, packed once every chunk is done
+    std::vector<std::vector<float>> chunk_distances;
+    std::vector<std::vector<std::pair<float, int>>> worker_heaps;  // nearest candidates of each worker, squared distance then id
+
+    // A thread count of 0 uses one worker per hardware thread
+    SpatialQueries(const Vec2& world_size, float cell_size = 2.0f, int threads = 0) : pool{threads}, grid{world_size, cell_size} {}
+
+    // Copies the particles, which must not change until it returns
+    void update(const Particles& particles) {
+        x = particles.x;
+        y = particles.y;
+        ids = particles.ids;
+        grid.build(x.data(), y.data(), x.size(), pool);
+    }
+
+    // Copies a snapshot published by the physics thread, ids of removed balls are skipped
+    void update(const PhysicsSnapshot& snapshot) {
+        x.clear();
+        y.clear();
+        ids.clear();
+        for (size_t id = 0; id < snapshot.x.size(); id++) {
+            if (snapshot.radius[id] > 0.0f) {
+                x.push_back(snapshot.x[id]);
+                y.push_back(snapshot.y[id]);
+                ids.push_back(id);
+            }
+        }
+        grid.build(x.data(), y.data(), x.size(), pool);
+    }
+
+    // Balls whose center is inside each circle
+    void queryRadius(std::span<const QueryCircle> queries, QueryResults& results) {
+        queryBounds(queries, results);
+    }
+
+    // Balls whose center is inside each box, left and top edges included, right and bottom edges excluded
+    void queryBox(std::span<const QuadCell> queries, QueryResults& results) {
+        queryBounds(queries, results);
+    }
+
+    void queryNearest(std::span<const NearestQuery> queries, QueryResults& results) {
+        worker_heaps.resize(pool.size());
+        runBatch(queries.size(), results, true, [&](int query, int worker, std::vector<int>& out, std::vector<float>& distances) {
+            findNearest(queries[query], worker_heaps[worker], out, distances);
+        });
+    }
+
+  private:
+    template <typename Bound>
+    void queryBounds(std::span<const Bound> queries, QueryResults& results) {
+        runBatch(queries.size(), results, false, [&](int query, int, std::vector<int>& out, std::vector<float>&) {
+            const size_t first = out.size();
+            grid.forEach(queries[query], [&](int i) { out.push_back(ids[i]); });
+            std::sort(out.begin() + first, out.end());
+        });
+    }
+
+    // Calls fn(query, worker, ids, distances) for every query, chunks of queries running in parallel and each appending
+    // to its own buffers, then packs the buffers of every chunk into results
+    template <typename Fn>
+    void runBatch(int count, QueryResults& results, bool with_distances, Fn&& fn) {
+        const int chunks = (count + chunk_size - 1) / chunk_size;
+        if (static_cast<int>(chunk_ids.size()) < chunks) {
+            chunk_ids.resize(chunks);
+            chunk_distances.resize(chunks);
+        }
+        results.offsets.assign(count + 1, 0);
+        pool.parallelTasks(chunks, [&](int chunk, int worker) {
+            std::vector<int>& out = chunk_ids[chunk];
+            std::vector<float>& distances = chunk_distances[chunk];
+            out.clear();
+            distances.clear();
+            const int end = std::min(count, (chunk + 1) * chunk_size);
+            for (int query = chunk * chunk_size; query < end; query++) {
+                const size_t first = out.size();
+                fn(query, worker, out, distances);
+                results.offsets[query + 1] = out.size() - first;
+            }
+        });
+
+        for (int query = 0; query < count; query++) {
+            results.offsets[query + 1] += results.offsets[query];
+        }
+        results.ids.resize(results.offsets[count]);
+        results.distances.resize(with_distances ? results.offsets[count] : 0);
+        pool.parallelTasks(chunks, [&](int chunk) {
+            const int first = results.offsets[chunk * chunk_size];
+            std::copy(chunk_ids[chunk].begin(), chunk_ids[chunk].end(), results.ids.begin() + first);
+            if (with_distances) {
+                std::copy(chunk_distances[chunk].begin(), chunk_distances[chunk].end(), results.distances.begin() + first);
+            }
+        });
+    }
+
+    // Searches rings of cells around the cell of the query, stopping once the next ring is further than the furthest
+    // of the count nearest balls found so far
+    void findNearest(const NearestQuery& query, std::vector<std::pair<float, int>>& heap, std::vector<int>& out, std::vector<float>& distances) const {
+        heap.clear();
+        if (query.count <= 0) {
+            return;
+        }
+        const float max_distance_sq = query.max_distance * query.max_distance;
+        const int center_x = grid.getCellX(query.position.x);
+        const int center_y = grid.getCellY(query.position.y);
+        const auto visit = [&](int begin, int end) {
+            for (int k = begin; k < end; k++) {
+                const QuadObject& obj = grid.objects[k];
+                const float dx = obj.position.x - query.position.x;
+                const float dy = obj.position.y - query.position.y;
+                const std::pair<float, int> candidate{dx * dx + dy * dy, ids[obj.id]};
+                if (candidate.first > max_distance_sq) {
+                    continue;
+                }
+                if (static_cast<int>(heap.size()) < query.count) {
+                    heap.push_back(candidate);
+                    std::push_heap(heap.begin(), heap.end());
+                } else if (candidate < heap.front()) {
+                    std::pop_heap(heap.begin(), heap.end());
+                    heap.back() = candidate;
+                    std::push_heap(heap.begin(), heap.end());
+                }
+            }
+        };
+
+        for (int ring = 0;; ring++) {
+            // Cells of this ring are at least ring - 1 cells away from the query
+            const float gap = std::max(0, ring - 1) * grid.cell_size;
+            if (gap * gap > max_distance_sq || (static_cast<int>(heap.size()) == query.count && heap.front().first <= gap * gap)) {
+                break;
+            }
+            if (center_x - ring < 0 && center_x + ring >= grid.width && center_y - ring < 0 && center_y + ring >= grid.height) {
+                break;
+            }
+            const int min_x = std::max(0, center_x - ring);
+            const int max_x = std::min(grid.width - 1, center_x + ring);
+            for (int cell_y = std::max(0, center_y - ring); cell_y <= std::min(grid.height - 1, center_y + ring); cell_y++) {
+                const int row = cell_y * grid.width;
+                if (cell_y == center_y - ring || cell_y == center_y + ring) {
+                    visit(grid.cell_start[row + min_x], grid.cell_start[row + max_x + 1]);
+                    continue;
+                }
+                if (center_x - ring >= 0) {
+                    visit(grid.cell_start[row + center_x - ring], grid.cell_start[row + center_x - ring + 1]);
+                }
+                if (ring > 0 && center_x + ring < grid.width) {
+                    visit(grid.cell_start[row + center_x + ring], grid.cell_start[row + center_x + ring + 1]);
+                }
+            }
+        }
+
+        std::sort_heap(heap.begin(), heap.end());
+        for (const auto& [distance_sq, id] : heap) {
+            out.push_back(id);
+            distances.push_back(std::sqrt(distance_sq));
+        }
+    }
+};
@@ -1,18 +1,61 @@
+#include <array>
 #include <chrono>
 #include <iostream>
+#include <string_view>
 
 #include "engine/physics/physics.hpp"
+#include "engine/physics/physics_thread.hpp"
+#include "engine/physics/snapshot.hpp"
 #include "renderer/renderer.hpp"
 
 using namespace std::chrono;
 
-int main() {
+// Adds a column of balls on the left wall until the world holds enough of them
+void emitObjects(PhysicsSolver& solver) {
+    if (solver.particles.size() < 26000) {
+        std::array<PhysicsObject, 20> objects;
+        for (int i = 20; i--;) {
+            PhysicsObject& object = objects[19 - i];
+            object.setPosition({2.0f, 10.0f + 1.1f * i});
+            object.last_position.x -= 0.2f;
+            object.color = sf::Color::White;
+        }
+        solver.addObjects(objects);
+    }
+}
+
+// An optional snapshot file given as argument is loaded instead of starting from an empty world.
+// With --pipelined the physics runs on its own thread at a fixed tick while this thread draws its latest snapshot.
+int main(int argc, char** argv) {
     const int window_width = 1000;
     const int window_height = 1000;
-    sf::RenderWindow window(sf::VideoMode(window_width, window_height), "VerletBalls", sf::Style::Close);
+
+    bool pipelined = false;
+    const char* snapshot_path = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (std::string_view{argv[i]} == "--pipelined") {
+            pipelined = true;
+        } else {
+            snapshot_path = argv[i];
+        }
+    }
 
     Vec2 world_size = {150, 150};
+    const std::optional<SnapshotHeader> snapshot = snapshot_path ? readSnapshotHeader(snapshot_path) : std::nullopt;
+    if (snapshot) {
+        world_size = {snapshot->world_width, snapshot->world_height};
+    } else if (snapshot_path) {
+        std::cerr << snapshot_path << " is not a snapshot\n";
+        return 1;
+    }
     PhysicsSolver solver{world_size};
+    solver.sleep_steps = 32;
+    if (snapshot && !loadSnapshot(solver, snapshot_path)) {
+        std::cerr << "Can't load " << snapshot_path << "\n";
+        return 1;
+    }
+
+    sf::RenderWindow window(sf::VideoMode(window_width, window_height), "VerletBalls", sf::Style::Close);
     Renderer renderer{solver};
 
     sf::View view(window.getDefaultView());
@@ -30,24 +73,38 @@ int main() {
     window.setFramerateLimit(fps_cap);
     const float dt = 1.0f / static_cast<float>(fps_cap);
 
+    PhysicsThread physics{solver, dt, emitObjects};
+    if (pipelined) {
+        physics.start();
+    }
+
     while (window.isOpen()) {
         elapsed = clock.restart();
 
-        if (solver.objects.size() < 26000) {
-            for (int i = 20; i--;) {
-                const auto id = solver.createObject({2.0f, 10.0f + 1.1f * i});
-                solver.objects[id].last_position.x -= 0.2f;
-                solver.objects[id].color = sf::Color::White;
-            }
+        steady_clock::duration solver_done{};
+        int sub_steps = 0;
+        int object_count = 0;
+        if (!pipelined) {
+            emitObjects(solver);
+            auto solver_start = steady_clock::now();
+            solver.update(dt);
+            solver_done = steady_clock::now() - solver_start;
+            sub_steps = solver.sub_steps;
+            object_count = solver.particles.size();
         }
 
-        auto solver_start = steady_clock::now();
-        solver.update(dt);
-        auto solver_done = steady_clock::now() - solver_start;
-
         window.clear();
         auto render_start = steady_clock::now();
-        renderer.render(window);
+        if (pipelined) {
+            physics.snapshots.update();
+            const PhysicsSnapshot& latest = physics.snapshots.getReadBuffer();
+            renderer.render(window, latest, physics.getInterpolation(latest, render_start));
+            solver_done = latest.update_time;
+            sub_steps = latest.sub_steps;
+            object_count = latest.x.size();
+        } else {
+            renderer.render(window);
+        }
 
         /* Show nodes */
         // for (auto& child : solver.qtree.nodes) {
@@ -68,11 +125,11 @@ int main() {
 
         if (steady_clock::now() - last_second >= 1s) {
             std::cout << "-------------------\n";
-            std::cout << "Running on " << solver.sub_steps << " substeps  \n";
+            std::cout << "Running on " << sub_steps << " substeps  \n";
             std::cout << "Frames per second: " << static_cast<int>(1.0f / elapsed.asSeconds()) << "\n";
             std::cout << "Physics took: " << duration_cast<milliseconds>(solver_done) << "\n";
             std::cout << "Rendering took: " << duration_cast<milliseconds>(render_done) << "\n";
-            std::cout << solver.objects.size() << std::endl;
+            std::cout << object_count << std::endl;
             std::cout << "-------------------\n";
             last_second = steady_clock::now();
         }
@@ -3,14 +3,18 @@
 #include <future>
 
 #include "engine/physics/physics.hpp"
+#include "engine/physics/physics_thread.hpp"
 
 struct Renderer {
     PhysicsSolver& solver;
     sf::VertexArray world_va;
-    sf::VertexArray objects_va;
+    sf::VertexBuffer objects_vb;         // persistent GPU copy of the ball quads, grown geometrically
+    std::vector<sf::Vertex> vertices;    // CPU side of objects_vb, texture coordinates and colors are only written once
+    int static_count = 0;                // balls whose texture coordinates and colors are written
+    int layout_version = 0;              // solver layout the colors were written for
     sf::Texture object_texture;
 
-    Renderer(PhysicsSolver& solver) : solver{solver}, world_va{sf::Quads, 4}, objects_va{sf::Quads} {
+    Renderer(PhysicsSolver& solver) : solver{solver}, world_va{sf::Quads, 4}, objects_vb{sf::Quads, sf::VertexBuffer::Stream} {
         initializeWorldVA();
 
         object_texture.loadFromFile("res/earth.png");
@@ -19,14 +23,34 @@ struct Renderer {
     }
 
     void render(sf::RenderWindow& window) {
+        updateObjects();
+        drawObjects(window);
+    }
+
+    // Draws a snapshot published by the physics thread, alpha in [0, 1] blends its previous positions into its current ones.
+    // Reads nothing from the solver, which is busy on the physics thread.
+    void render(sf::RenderWindow& window, const PhysicsSnapshot& snapshot, float alpha) {
+        updateObjects(snapshot, alpha);
+        drawObjects(window);
+    }
+
+    void drawObjects(sf::RenderWindow& window) {
         window.draw(world_va);
 
         sf::RenderStates states;
         states.texture = &object_texture;
         window.draw(world_va, states);
 
-        updateObjectsVA();
-        window.draw(objects_va, states);
+        const size_t count = vertices.size();
+        if (sf::VertexBuffer::isAvailable()) {
+            if (objects_vb.getVertexCount() < count) {
+                objects_vb.create(std::max(count, 2 * objects_vb.getVertexCount()));
+            }
+            objects_vb.update(vertices.data(), count, 0);
+            window.draw(objects_vb, 0, count, states);
+        } else {
+            window.draw(vertices.data(), count, sf::Quads, states);
+        }
     }
 
     void initializeWorldVA() {
@@ -43,28 +67,79 @@ struct Renderer {
         world_va[3].color = background_color;
     }
 
-    void updateObjectsVA() {
-        objects_va.resize(solver.objects.size() * 4);
-
+    // Texture coordinates and colors of the balls in [begin, end)
+    void writeStaticAttributes(int begin, int end, const sf::Color* colors) {
         const float texture_size = 1024.0f;
-        const float radius = 0.5f;
-        for (int i = 0; i < solver.objects.size(); ++i) {
-            const PhysicsObject& object = solver.objects[i];
+        for (int i = begin; i < end; ++i) {
             const int idx = i << 2;
-            objects_va[idx + 0].position = object.position + Vec2{-radius, -radius};
-            objects_va[idx + 1].position = object.position + Vec2{radius, -radius};
-            objects_va[idx + 2].position = object.position + Vec2{radius, radius};
-            objects_va[idx + 3].position = object.position + Vec2{-radius, radius};
-            objects_va[idx + 0].texCoords = {0.0f, 0.0f};
-            objects_va[idx + 1].texCoords = {texture_size, 0.0f};
-            objects_va[idx + 2].texCoords = {texture_size, texture_size};
-            objects_va[idx + 3].texCoords = {0.0f, texture_size};
-
-            const sf::Color color = object.color;
-            objects_va[idx + 0].color = color;
-            objects_va[idx + 1].color = color;
-            objects_va[idx + 2].color = color;
-            objects_va[idx + 3].color = color;
+            vertices[idx + 0].texCoords = {0.0f, 0.0f};
+            vertices[idx + 1].texCoords = {texture_size, 0.0f};
+            vertices[idx + 2].texCoords = {texture_size, texture_size};
+            vertices[idx + 3].texCoords = {0.0f, texture_size};
+
+            const sf::Color color = colors[i];
+            vertices[idx + 0].color = color;
+            vertices[idx + 1].color = color;
+            vertices[idx + 2].color = color;
+            vertices[idx + 3].color = color;
+        }
+    }
+
+    // Only new balls get their static attributes, all of them when the balls moved to other indices
+    void updateStaticAttributes(int count, const sf::Color* colors, int version) {
+        vertices.resize(count * 4);
+        if (layout_version != version) {
+            layout_version = version;
+            static_count = 0;
         }
-    };
+        static_count = std::min(static_count, count);
+        writeStaticAttributes(static_count, count, colors);
+        static_count = count;
+    }
+
+    // Quad corners of the balls in [begin, end), position(i) gives the center of ball i
+    template <typename Position>
+    void writePositions(int begin, int end, const float* radius, Position&& position) {
+        sf::Vertex* out = vertices.data();
+        for (int i = begin; i < end; ++i) {
+            const Vec2 center = position(i);
+            const float left = center.x - radius[i];
+            const float right = center.x + radius[i];
+            const float top = center.y - radius[i];
+            const float bottom = center.y + radius[i];
+            sf::Vertex* quad = out + (i << 2);
+            quad[0].position = {left, top};
+            quad[1].position = {right, top};
+            quad[2].position = {right, bottom};
+            quad[3].position = {left, bottom};
+        }
+    }
+
+    // Positions are written by every worker of the solver straight from its position arrays
+    void updateObjects() {
+        const Particles& particles = solver.particles;
+        const int count = particles.size();
+        updateStaticAttributes(count, solver.colors.data(), solver.layout_version);
+
+        const float* x = particles.x.data();
+        const float* y = particles.y.data();
+        solver.pool.parallelFor(count, [&](int begin, int end) {
+            writePositions(begin, end, particles.radius.data(), [&](int i) { return Vec2{x[i], y[i]}; });
+        });
+    }
+
+    // Snapshots keep balls in id order, so colors only need writing for new balls until an id is reused.
+    // The solver pool belongs to the physics thread, so positions are written by this thread alone.
+    void updateObjects(const PhysicsSnapshot& snapshot, float alpha) {
+        const int count = snapshot.x.size();
+        updateStaticAttributes(count, snapshot.colors.data(), snapshot.layout_version);
+
+        const float* x = snapshot.x.data();
+        const float* y = snapshot.y.data();
+        const float* previous_x = snapshot.previous_x.data();
+        const float* previous_y = snapshot.previous_y.data();
+        writePositions(0, count, snapshot.radius.data(), [&](int i) {
+            return Vec2{previous_x[i] + (x[i] - previous_x[i]) * alpha, previous_y[i] + (y[i] - previous_y[i]) * alpha};
+        });
+    }
 };